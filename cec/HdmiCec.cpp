@@ -0,0 +1,290 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ * Copyright (C) 2024 KonstaKANG
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "android.hardware.tv.hdmi.cec-service.rpi"
+
+#include "HdmiCec.h"
+
+#include <android-base/logging.h>
+#include <errno.h>
+#include <string.h>
+
+namespace aidl::android::hardware::tv::hdmi {
+
+HdmiConnection::HdmiConnection(hdmi_cec_device_t* device)
+    : mDevice(device),
+      mDeathRecipient(AIBinder_DeathRecipient_new(serviceDied)) {}
+
+ndk::ScopedAStatus HdmiConnection::getPortInfo(std::vector<HdmiPortInfo>* _aidl_return) {
+    struct hdmi_port_info* legacyPorts = nullptr;
+    int numPorts = 0;
+
+    mDevice->get_port_info(mDevice, &legacyPorts, &numPorts);
+
+    _aidl_return->clear();
+    for (int i = 0; i < numPorts; i++) {
+        HdmiPortInfo port;
+        port.type = static_cast<connection::HdmiPortType>(legacyPorts[i].type);
+        port.portId = legacyPorts[i].port_id;
+        port.cecSupported = legacyPorts[i].cec_supported;
+        port.arcSupported = legacyPorts[i].arc_supported;
+        port.eArcSupported = false;
+        port.physicalAddress = legacyPorts[i].physical_address;
+        _aidl_return->push_back(port);
+    }
+
+    return ndk::ScopedAStatus::ok();
+}
+
+ndk::ScopedAStatus HdmiConnection::isConnected(int32_t portId, bool* _aidl_return) {
+    *_aidl_return = mDevice->is_connected(mDevice, portId) > 0;
+    return ndk::ScopedAStatus::ok();
+}
+
+ndk::ScopedAStatus HdmiConnection::setCallback(
+        const std::shared_ptr<IHdmiConnectionCallback>& callback) {
+    std::lock_guard<std::mutex> lock(mCallbackLock);
+
+    if (mCallback != nullptr) {
+        AIBinder_unlinkToDeath(mCallback->asBinder().get(), mDeathRecipient.get(), this);
+    }
+
+    mCallback = callback;
+    if (mCallback != nullptr) {
+        AIBinder_linkToDeath(mCallback->asBinder().get(), mDeathRecipient.get(), this);
+    }
+
+    return ndk::ScopedAStatus::ok();
+}
+
+ndk::ScopedAStatus HdmiConnection::setHpdSignal(HpdSignal signal, int32_t portId) {
+    (void)portId;
+
+    // The kernel drives hot plug detection, only the physical line is available
+    if (signal != HpdSignal::HDMI_HPD_PHYSICAL) {
+        return ndk::ScopedAStatus::fromServiceSpecificError(
+                static_cast<int32_t>(Result::FAILURE_NOT_SUPPORTED));
+    }
+
+    return ndk::ScopedAStatus::ok();
+}
+
+ndk::ScopedAStatus HdmiConnection::getHpdSignal(int32_t portId, HpdSignal* _aidl_return) {
+    (void)portId;
+    *_aidl_return = HpdSignal::HDMI_HPD_PHYSICAL;
+    return ndk::ScopedAStatus::ok();
+}
+
+void HdmiConnection::onHotplugEvent(bool connected, int32_t portId) {
+    std::shared_ptr<IHdmiConnectionCallback> callback;
+    {
+        std::lock_guard<std::mutex> lock(mCallbackLock);
+        callback = mCallback;
+    }
+
+    if (callback != nullptr) {
+        callback->onHotplugEvent(connected, portId);
+    }
+}
+
+void HdmiConnection::serviceDied(void* cookie) {
+    HdmiConnection* connection = static_cast<HdmiConnection*>(cookie);
+    std::lock_guard<std::mutex> lock(connection->mCallbackLock);
+
+    LOG(ERROR) << "HdmiConnection callback died";
+    connection->mCallback = nullptr;
+}
+
+HdmiCec::HdmiCec(const hdmi_cec_rpi_module_t* module, hdmi_cec_device_t* device,
+        std::shared_ptr<HdmiConnection> connection)
+    : mModule(module),
+      mDevice(device),
+      mConnection(connection),
+      mDeathRecipient(AIBinder_DeathRecipient_new(serviceDied)) {
+    mDevice->register_event_callback(mDevice, eventCallback, this);
+}
+
+ndk::ScopedAStatus HdmiCec::addLogicalAddress(CecLogicalAddress addr, Result* _aidl_return) {
+    int ret = mDevice->add_logical_address(mDevice, static_cast<cec_logical_address_t>(addr));
+
+    switch (ret) {
+        case 0:
+            *_aidl_return = Result::SUCCESS;
+            break;
+        case -EINVAL:
+            *_aidl_return = Result::FAILURE_INVALID_ARGS;
+            break;
+        case -EBUSY:
+            *_aidl_return = Result::FAILURE_BUSY;
+            break;
+        default:
+            *_aidl_return = Result::FAILURE_UNKNOWN;
+            break;
+    }
+    return ndk::ScopedAStatus::ok();
+}
+
+ndk::ScopedAStatus HdmiCec::clearLogicalAddress() {
+    mDevice->clear_logical_address(mDevice);
+    return ndk::ScopedAStatus::ok();
+}
+
+ndk::ScopedAStatus HdmiCec::enableAudioReturnChannel(int32_t portId, bool enable) {
+    mDevice->set_audio_return_channel(mDevice, portId, enable ? 1 : 0);
+    return ndk::ScopedAStatus::ok();
+}
+
+ndk::ScopedAStatus HdmiCec::getCecVersion(int32_t* _aidl_return) {
+    int version = 0;
+
+    mDevice->get_version(mDevice, &version);
+    *_aidl_return = version;
+    return ndk::ScopedAStatus::ok();
+}
+
+ndk::ScopedAStatus HdmiCec::getPhysicalAddress(int32_t* _aidl_return) {
+    uint16_t addr = 0;
+
+    if (mDevice->get_physical_address(mDevice, &addr) != 0) {
+        return ndk::ScopedAStatus::fromServiceSpecificError(
+                static_cast<int32_t>(Result::FAILURE_INVALID_STATE));
+    }
+
+    *_aidl_return = addr;
+    return ndk::ScopedAStatus::ok();
+}
+
+ndk::ScopedAStatus HdmiCec::getVendorId(int32_t* _aidl_return) {
+    uint32_t vendorId = 0;
+
+    mDevice->get_vendor_id(mDevice, &vendorId);
+    *_aidl_return = vendorId;
+    return ndk::ScopedAStatus::ok();
+}
+
+ndk::ScopedAStatus HdmiCec::sendMessage(const CecMessage& message,
+        SendMessageResult* _aidl_return) {
+    cec_message_t legacyMessage = {};
+
+    if (message.body.size() > sizeof(legacyMessage.body)) {
+        *_aidl_return = SendMessageResult::FAIL;
+        return ndk::ScopedAStatus::ok();
+    }
+
+    legacyMessage.initiator = static_cast<cec_logical_address_t>(message.initiator);
+    legacyMessage.destination = static_cast<cec_logical_address_t>(message.destination);
+    legacyMessage.length = message.body.size();
+    memcpy(legacyMessage.body, message.body.data(), message.body.size());
+
+    // HDMI_RESULT_* and SendMessageResult share their values
+    *_aidl_return = static_cast<SendMessageResult>(mDevice->send_message(mDevice, &legacyMessage));
+    return ndk::ScopedAStatus::ok();
+}
+
+ndk::ScopedAStatus HdmiCec::setCallback(const std::shared_ptr<IHdmiCecCallback>& callback) {
+    std::lock_guard<std::mutex> lock(mCallbackLock);
+
+    if (mCallback != nullptr) {
+        AIBinder_unlinkToDeath(mCallback->asBinder().get(), mDeathRecipient.get(), this);
+    }
+
+    mCallback = callback;
+    if (mCallback != nullptr) {
+        AIBinder_linkToDeath(mCallback->asBinder().get(), mDeathRecipient.get(), this);
+    }
+
+    return ndk::ScopedAStatus::ok();
+}
+
+ndk::ScopedAStatus HdmiCec::setLanguage(const std::string& language) {
+    if (language.size() != 3) {
+        LOG(ERROR) << "Wrong language code: expected 3 letters, but it was " << language.size();
+        return ndk::ScopedAStatus::ok();
+    }
+
+    // ISO 639-2 code packed into the low 24 bits
+    int convertedLanguage = ((language[0] & 0xff) << 16) | ((language[1] & 0xff) << 8) |
+            (language[2] & 0xff);
+    mDevice->set_option(mDevice, HDMI_OPTION_SET_LANG, convertedLanguage);
+    return ndk::ScopedAStatus::ok();
+}
+
+ndk::ScopedAStatus HdmiCec::enableWakeupByOtp(bool value) {
+    mDevice->set_option(mDevice, HDMI_OPTION_WAKEUP, value ? 1 : 0);
+    return ndk::ScopedAStatus::ok();
+}
+
+ndk::ScopedAStatus HdmiCec::enableCec(bool value) {
+    mDevice->set_option(mDevice, HDMI_OPTION_ENABLE_CEC, value ? 1 : 0);
+    return ndk::ScopedAStatus::ok();
+}
+
+ndk::ScopedAStatus HdmiCec::enableSystemCecControl(bool value) {
+    mDevice->set_option(mDevice, HDMI_OPTION_SYSTEM_CEC_CONTROL, value ? 1 : 0);
+    return ndk::ScopedAStatus::ok();
+}
+
+binder_status_t HdmiCec::dump(int fd, const char** args, uint32_t numArgs) {
+    (void)args;
+    (void)numArgs;
+
+    if (mModule->dump != nullptr) {
+        mModule->dump(mDevice, fd);
+    }
+
+    return STATUS_OK;
+}
+
+void HdmiCec::eventCallback(const hdmi_event_t* event, void* arg) {
+    HdmiCec* hdmiCec = static_cast<HdmiCec*>(arg);
+
+    switch (event->type) {
+        case HDMI_EVENT_CEC_MESSAGE: {
+            CecMessage message;
+            message.initiator = static_cast<CecLogicalAddress>(event->cec.initiator);
+            message.destination = static_cast<CecLogicalAddress>(event->cec.destination);
+            message.body.assign(event->cec.body, event->cec.body + event->cec.length);
+
+            // Call out without the lock, a framework call back into us must not wait on it
+            std::shared_ptr<IHdmiCecCallback> callback;
+            {
+                std::lock_guard<std::mutex> lock(hdmiCec->mCallbackLock);
+                callback = hdmiCec->mCallback;
+            }
+            if (callback != nullptr) {
+                callback->onCecMessage(message);
+            }
+            break;
+        }
+        case HDMI_EVENT_HOT_PLUG:
+            hdmiCec->mConnection->onHotplugEvent(event->hotplug.connected,
+                    event->hotplug.port_id);
+            break;
+        default:
+            break;
+    }
+}
+
+void HdmiCec::serviceDied(void* cookie) {
+    HdmiCec* hdmiCec = static_cast<HdmiCec*>(cookie);
+    std::lock_guard<std::mutex> lock(hdmiCec->mCallbackLock);
+
+    LOG(ERROR) << "HdmiCec callback died";
+    hdmiCec->mCallback = nullptr;
+}
+
+}  // aidl::android::hardware::tv::hdmi
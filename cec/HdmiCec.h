@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ * Copyright (C) 2024 KonstaKANG
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <aidl/android/hardware/tv/hdmi/cec/BnHdmiCec.h>
+#include <aidl/android/hardware/tv/hdmi/connection/BnHdmiConnection.h>
+#include <hardware/hdmi_cec.h>
+
+#include <mutex>
+
+#include "hdmi_cec_rpi.h"
+
+namespace aidl::android::hardware::tv::hdmi {
+
+using cec::BnHdmiCec;
+using cec::CecLogicalAddress;
+using cec::CecMessage;
+using cec::IHdmiCecCallback;
+using cec::Result;
+using cec::SendMessageResult;
+using connection::BnHdmiConnection;
+using connection::HdmiPortInfo;
+using connection::HpdSignal;
+using connection::IHdmiConnectionCallback;
+
+/*
+ * Both services run on the hdmi_cec.rpi device opened in this process, its
+ * events go straight to the binder callbacks without another hop.
+ */
+class HdmiConnection : public BnHdmiConnection {
+public:
+    explicit HdmiConnection(hdmi_cec_device_t* device);
+
+    ndk::ScopedAStatus getPortInfo(std::vector<HdmiPortInfo>* _aidl_return) override;
+    ndk::ScopedAStatus isConnected(int32_t portId, bool* _aidl_return) override;
+    ndk::ScopedAStatus setCallback(const std::shared_ptr<IHdmiConnectionCallback>& callback) override;
+    ndk::ScopedAStatus setHpdSignal(HpdSignal signal, int32_t portId) override;
+    ndk::ScopedAStatus getHpdSignal(int32_t portId, HpdSignal* _aidl_return) override;
+
+    void onHotplugEvent(bool connected, int32_t portId);
+
+private:
+    static void serviceDied(void* cookie);
+
+    hdmi_cec_device_t* mDevice;
+    std::mutex mCallbackLock;
+    std::shared_ptr<IHdmiConnectionCallback> mCallback;
+    ndk::ScopedAIBinder_DeathRecipient mDeathRecipient;
+};
+
+class HdmiCec : public BnHdmiCec {
+public:
+    HdmiCec(const hdmi_cec_rpi_module_t* module, hdmi_cec_device_t* device,
+            std::shared_ptr<HdmiConnection> connection);
+
+    ndk::ScopedAStatus addLogicalAddress(CecLogicalAddress addr, Result* _aidl_return) override;
+    ndk::ScopedAStatus clearLogicalAddress() override;
+    ndk::ScopedAStatus enableAudioReturnChannel(int32_t portId, bool enable) override;
+    ndk::ScopedAStatus getCecVersion(int32_t* _aidl_return) override;
+    ndk::ScopedAStatus getPhysicalAddress(int32_t* _aidl_return) override;
+    ndk::ScopedAStatus getVendorId(int32_t* _aidl_return) override;
+    ndk::ScopedAStatus sendMessage(const CecMessage& message, SendMessageResult* _aidl_return) override;
+    ndk::ScopedAStatus setCallback(const std::shared_ptr<IHdmiCecCallback>& callback) override;
+    ndk::ScopedAStatus setLanguage(const std::string& language) override;
+    ndk::ScopedAStatus enableWakeupByOtp(bool value) override;
+    ndk::ScopedAStatus enableCec(bool value) override;
+    ndk::ScopedAStatus enableSystemCecControl(bool value) override;
+
+    binder_status_t dump(int fd, const char** args, uint32_t numArgs) override;
+
+private:
+    static void eventCallback(const hdmi_event_t* event, void* arg);
+    static void serviceDied(void* cookie);
+
+    const hdmi_cec_rpi_module_t* mModule;
+    hdmi_cec_device_t* mDevice;
+    std::shared_ptr<HdmiConnection> mConnection;
+    std::mutex mCallbackLock;
+    std::shared_ptr<IHdmiCecCallback> mCallback;
+    ndk::ScopedAIBinder_DeathRecipient mDeathRecipient;
+};
+
+}  // aidl::android::hardware::tv::hdmi
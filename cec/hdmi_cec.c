@@ -16,66 +16,456 @@
  */
 
 #define LOG_TAG "hdmi_cec"
+#define ATRACE_TAG ATRACE_TAG_HAL
 
 #include <stdint.h>
+#include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
 
 #include <sys/ioctl.h>
 #include <sys/types.h>
 
 #include <poll.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <linux/netlink.h>
 #include <linux/cec.h>
 #include <sys/eventfd.h>
+#include <sys/timerfd.h>
 
 #include <log/log.h>
 #include <cutils/properties.h>
+#include <cutils/trace.h>
 #include <hardware/hdmi_cec.h>
 
+#include "hdmi_cec_rpi.h"
+
+/* Bits of hdmicec_context.options */
+#define CEC_OPTION_ENABLED         (1u << 0)
+#define CEC_OPTION_CONTROL_ENABLED (1u << 1)
+
+/* Raspberry Pi 4 has one CEC adapter per HDMI port */
+#define CEC_MAX_ADAPTERS 2
+
+/* epoll_event.data.u32 in event_thread: adapter index << 8 | source */
+enum cec_poll_source {
+    CEC_POLL_EXIT,
+    CEC_POLL_ADAPTER,
+    CEC_POLL_TX,
+    CEC_POLL_KEY,
+};
+
+#define CEC_POLL_DATA(index, source) (((index) << 8) | (source))
+
+/* Upper bound for a caller waiting on its transmit result */
+#define CEC_TX_TIMEOUT_MS 2000
+
+/* Upper bound for holding transmits back while a logical address is claimed */
+#define CEC_CLAIM_TIMEOUT_MS 1000
+
+enum cec_tx_priority {
+    CEC_TX_PRIO_HIGH,   /* polls, replies and user control */
+    CEC_TX_PRIO_NORMAL,
+    CEC_TX_PRIO_LOW,    /* bulk OSD and vendor updates, not waited for */
+    CEC_TX_PRIO_COUNT,
+};
+
+/* Received events waiting for dispatch, must be a power of two */
+#define CEC_EVENT_RING_SIZE 64
+
+/*
+ * Single producer (event_thread), single consumer (dispatch_thread) ring.
+ * head and tail run freely and are masked on access.
+ */
+struct cec_event_ring {
+    atomic_uint head;
+    atomic_uint tail;
+    hdmi_event_t events[CEC_EVENT_RING_SIZE];
+    uint64_t rx_ts[CEC_EVENT_RING_SIZE]; /* kernel receive time, 0 if not a received frame */
+};
+
+/* Latency histogram bucket upper bounds, the last bucket is open ended */
+static const unsigned int cec_latency_bounds_ms[] = { 10, 25, 50, 100, 250, 500, 1000 };
+
+#define CEC_LATENCY_BUCKETS (sizeof(cec_latency_bounds_ms) / sizeof(cec_latency_bounds_ms[0]) + 1)
+
+/*
+ * Statistics are relaxed atomics so the bus threads never block on each
+ * other or on a dump; a dump reads each counter on its own.
+ */
+struct cec_latency_hist {
+    atomic_uint count[CEC_LATENCY_BUCKETS];
+    atomic_uint samples;
+    atomic_ullong total_us;
+    atomic_ullong max_us;
+};
+
+struct cec_opcode_stats {
+    atomic_uint tx;          /* frames handed to the kernel */
+    atomic_uint tx_ok;
+    atomic_uint tx_nack;
+    atomic_uint tx_arb_lost;
+    atomic_uint tx_error;    /* anything else, including rejected transmits */
+    atomic_uint tx_retries;  /* failed attempts the kernel retried */
+    atomic_uint rx;
+};
+
+/* Frames without an opcode (polls) are counted after the 256 opcodes */
+#define CEC_STATS_POLL 256
+
+/* Bus trace kept for dump, must be a power of two */
+#define CEC_TRACE_SIZE 128
+
+enum cec_trace_dir {
+    CEC_TRACE_RX,
+    CEC_TRACE_TX,
+    CEC_TRACE_STATE, /* msg holds the physical address and log_addr_mask */
+};
+
+struct cec_trace_record {
+    uint64_t ts;      /* kernel timestamp, CLOCK_MONOTONIC ns */
+    unsigned int pos; /* trace_head when added, tells a lapped slot apart */
+    uint8_t port;
+    uint8_t dir;
+    uint8_t status;   /* rx_status or tx_status */
+    uint8_t len;
+    uint8_t msg[CEC_MAX_MSG_SIZE];
+};
+
+/* seq is odd while event_thread rewrites the record */
+struct cec_trace_entry {
+    atomic_uint seq;
+    struct cec_trace_record rec;
+};
+
+struct cec_stats {
+    struct cec_opcode_stats opcode[CEC_STATS_POLL + 1];
+    struct cec_latency_hist tx_latency; /* CEC_TRANSMIT to result */
+    struct cec_latency_hist rx_latency; /* kernel receive to callback */
+    /*
+     * Only event_thread adds to the trace: received frames, state changes
+     * and transmit results all come in through its epoll loop.
+     */
+    atomic_uint trace_head;
+    struct cec_trace_entry trace[CEC_TRACE_SIZE];
+};
+
+/* Replies the HAL can give on the framework's behalf while in standby */
+enum cec_answer {
+    CEC_ANSWER_PHYSICAL_ADDRESS,
+    CEC_ANSWER_OSD_NAME,
+    CEC_ANSWER_VENDOR_ID,
+    CEC_ANSWER_CEC_VERSION,
+    CEC_ANSWER_COUNT,
+};
+
+/*
+ * Last reply bodies sent by the framework, opcode included. Updated under
+ * tx_lock, read locklessly by event_thread; seq is odd while an update is
+ * in progress.
+ */
+struct cec_answer_cache {
+    atomic_uint seq;
+    uint8_t len[CEC_ANSWER_COUNT];
+    uint8_t body[CEC_ANSWER_COUNT][CEC_MAX_MSG_SIZE - 1];
+};
+
+struct cec_adapter {
+    int index; /* port id - 1, the position in ro.hdmi.cec_device */
+    int cec_fd;
+    int tx_fd;
+    atomic_uint state; /* physical address | log_addr_mask << 16 */
+    /* Protected by tx_lock */
+    struct cec_tx_request *tx_inflight;
+    bool claim_pending;
+    cec_logical_address_t claim_addr;
+    struct timespec claim_deadline;
+    /* Protected by claim_lock */
+    bool claim_deferred;
+    struct cec_log_addrs claim_laddrs; /* applied once the running claim ends */
+};
+
+/* Release timeout when ro.hdmi.cec_key_release_ms is unset, the CEC follower safety timeout */
+#define CEC_KEY_RELEASE_MS 550
+
+/* Remote key being held, only touched by event_thread */
+struct cec_key_state {
+    bool held;
+    bool repeating;          /* the remote repeated the press, repeats are paced from here */
+    struct timespec last_rx; /* last press from the remote, sampled on each tick */
+    hdmi_event_t event;      /* the <User Control Pressed> to repeat */
+};
+
+struct cec_tx_request {
+    struct cec_tx_request *next;
+    struct cec_adapter *adap;
+    struct cec_msg msg;
+    uint64_t submit_ns; /* CEC_TRANSMIT entry */
+    int result;
+    bool done;
+    bool detached; /* nobody waits for the result, freed on completion */
+};
+
 typedef struct hdmicec_context
 {
     hdmi_cec_device_t device; /* must be first */
-    int cec_fd;
+    struct cec_adapter adapters[CEC_MAX_ADAPTERS];
+    int num_adapters;
+    int epoll_fd;
+    atomic_int route[CEC_ADDR_BROADCAST]; /* logical address -> port id */
     unsigned int vendor_id;
     unsigned int type;
     unsigned int version;
-    struct hdmi_port_info port_info;
+    struct hdmi_port_info port_info[CEC_MAX_ADAPTERS];
     event_callback_t p_event_cb;
     void *cb_arg;
     pthread_t thread;
+    bool thread_started;
     int exit_fd;
-    pthread_mutex_t options_lock;
-    bool cec_enabled;
-    bool cec_control_enabled;
+    pthread_t dispatch_thread;
+    bool dispatch_thread_started;
+    int dispatch_fd;
+    struct cec_event_ring rx_ring;
+    atomic_uint rx_dropped; /* ring full, dropped in the HAL */
+    atomic_uint rx_lost;    /* receive queue overflow reported by the kernel */
+    atomic_uint options; /* CEC_OPTION_*, read as one snapshot */
+    atomic_uint boot_otp_ports; /* adapters still to announce one touch play at boot */
+    int key_fd;          /* timerfd pacing key repeats */
+    int key_repeat_ms;   /* 0 passes every press through */
+    int key_release_ms;
+    struct cec_key_state key;
+    pthread_mutex_t claim_lock; /* serialises CEC_ADAP_S_LOG_ADDRS, taken before tx_lock */
+    pthread_t tx_thread;
+    bool tx_thread_started;
+    pthread_mutex_t tx_lock;
+    pthread_cond_t tx_cond;      /* queue or in-flight slot changed */
+    pthread_cond_t tx_done_cond; /* a waited for request completed */
+    struct cec_tx_request *tx_head[CEC_TX_PRIO_COUNT];
+    struct cec_tx_request *tx_tail[CEC_TX_PRIO_COUNT];
+    bool tx_exit;
+    struct cec_answer_cache answers;
+    struct cec_stats stats;
 } hdmicec_context_t;
 
-static int hdmicec_add_logical_address(const struct hdmi_cec_device *dev, cec_logical_address_t addr)
+static inline unsigned int cec_state_pack(uint16_t phys_addr, uint16_t log_addr_mask)
+{
+    return phys_addr | ((unsigned int)log_addr_mask << 16);
+}
+
+static inline uint16_t cec_state_phys_addr(unsigned int state)
+{
+    return state & 0xffff;
+}
+
+static inline uint16_t cec_state_log_addr_mask(unsigned int state)
+{
+    return state >> 16;
+}
+
+static inline bool cec_adapter_connected(struct cec_adapter *adap)
+{
+    return cec_state_phys_addr(atomic_load(&adap->state)) != CEC_PHYS_ADDR_INVALID;
+}
+
+/* Adapters that failed to open leave a gap in the port ids */
+static struct cec_adapter *cec_adapter_by_port(struct hdmicec_context *ctx, int port_id)
+{
+    int i;
+
+    for (i = 0; i < ctx->num_adapters; i++) {
+        if (ctx->adapters[i].index == port_id - 1)
+            return &ctx->adapters[i];
+    }
+
+    return NULL;
+}
+
+/*
+ * Picks the adapter a message to dest goes out on: the port dest was last
+ * heard on, else the first connected port.
+ */
+static struct cec_adapter *cec_route(struct hdmicec_context *ctx, int dest)
+{
+    int i;
+
+    if (dest < CEC_ADDR_BROADCAST) {
+        struct cec_adapter *adap = cec_adapter_by_port(ctx,
+                atomic_load_explicit(&ctx->route[dest], memory_order_relaxed));
+        if (adap != NULL && cec_adapter_connected(adap))
+            return adap;
+    }
+
+    for (i = 0; i < ctx->num_adapters; i++) {
+        if (cec_adapter_connected(&ctx->adapters[i]))
+            return &ctx->adapters[i];
+    }
+
+    return &ctx->adapters[0];
+}
+
+static void cec_deadline(struct timespec *ts, int timeout_ms)
+{
+    clock_gettime(CLOCK_MONOTONIC, ts);
+    ts->tv_sec += timeout_ms / 1000;
+    ts->tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+/* Sets laddrs, or releases the addresses if it has none. Called with claim_lock held. */
+static int cec_adapter_set_log_addrs(struct cec_adapter *adap, const struct cec_log_addrs *laddrs)
+{
+    struct cec_log_addrs tmp;
+
+    // The adapter only accepts new addresses once the current ones are released
+    if (laddrs->num_log_addrs == 0 || cec_state_log_addr_mask(atomic_load(&adap->state))) {
+        memset(&tmp, 0, sizeof(tmp));
+        if (ioctl(adap->cec_fd, CEC_ADAP_S_LOG_ADDRS, &tmp))
+            return -errno;
+    }
+
+    if (laddrs->num_log_addrs == 0)
+        return 0;
+
+    tmp = *laddrs;
+    if (ioctl(adap->cec_fd, CEC_ADAP_S_LOG_ADDRS, &tmp))
+        return -errno;
+
+    return 0;
+}
+
+/* Called with claim_lock held */
+static int cec_adapter_claim_locked(struct hdmicec_context *ctx, struct cec_adapter *adap,
+        const struct cec_log_addrs *laddrs, cec_logical_address_t addr)
+{
+    int ret;
+
+    /*
+     * cec_fd is non-blocking, so the kernel claims the address in the
+     * background and reports the outcome with CEC_EVENT_STATE_CHANGE.
+     * Transmits are held back until then, they would be rejected for an
+     * initiator that is not claimed yet. A disconnected port only claims
+     * once it sees a hot-plug, nothing waits for it.
+     */
+    pthread_mutex_lock(&ctx->tx_lock);
+    adap->claim_pending = laddrs->num_log_addrs > 0 && cec_adapter_connected(adap);
+    adap->claim_addr = addr;
+    cec_deadline(&adap->claim_deadline, CEC_CLAIM_TIMEOUT_MS);
+    pthread_mutex_unlock(&ctx->tx_lock);
+
+    adap->claim_deferred = false;
+    ret = cec_adapter_set_log_addrs(adap, laddrs);
+    if (ret == -EBUSY) {
+        /*
+         * The kernel takes no new addresses, not even a release, while a
+         * claim is still running, e.g. the boot claim. Keep the latest
+         * request and apply it once CEC_EVENT_STATE_CHANGE ends that claim.
+         */
+        ALOGI("%s: port %d busy claiming, deferring %x\n", __func__, adap->index + 1,
+                laddrs->num_log_addrs ? addr : CEC_ADDR_UNREGISTERED);
+        adap->claim_laddrs = *laddrs;
+        adap->claim_deferred = true;
+        return 0;
+    }
+
+    if (ret) {
+        errno = -ret;
+        ALOGE("%s: port %d claiming %x failed: %m\n", __func__, adap->index + 1, addr);
+        pthread_mutex_lock(&ctx->tx_lock);
+        adap->claim_pending = false;
+        pthread_cond_signal(&ctx->tx_cond);
+        pthread_mutex_unlock(&ctx->tx_lock);
+    }
+
+    return ret;
+}
+
+/* An empty laddrs releases the addresses of adap */
+static int cec_adapter_claim(struct hdmicec_context *ctx, struct cec_adapter *adap,
+        const struct cec_log_addrs *laddrs, cec_logical_address_t addr)
+{
+    int ret;
+
+    pthread_mutex_lock(&ctx->claim_lock);
+    ret = cec_adapter_claim_locked(ctx, adap, laddrs, addr);
+    pthread_mutex_unlock(&ctx->claim_lock);
+
+    return ret;
+}
+
+/*
+ * Applies a request deferred while the kernel was busy claiming, called on
+ * every CEC_EVENT_STATE_CHANGE. Returns true if there was one, the state
+ * change then belongs to the claim it waited for.
+ */
+static bool cec_adapter_claim_deferred(struct hdmicec_context *ctx, struct cec_adapter *adap)
+{
+    struct cec_log_addrs laddrs;
+    bool deferred;
+
+    pthread_mutex_lock(&ctx->claim_lock);
+    deferred = adap->claim_deferred;
+    if (deferred) {
+        laddrs = adap->claim_laddrs;
+        cec_adapter_claim_locked(ctx, adap, &laddrs, adap->claim_addr);
+    }
+    pthread_mutex_unlock(&ctx->claim_lock);
+
+    return deferred;
+}
+
+static unsigned int cec_answer_read(struct hdmicec_context *ctx, int slot, struct cec_msg *msg);
+
+/*
+ * OSD name the kernel answers <Give OSD Name> with while it handles core
+ * messages: the last name the framework reported, else the product model.
+ */
+static void cec_osd_name(struct hdmicec_context *ctx, char *name, size_t size)
+{
+    char prop[PROPERTY_VALUE_MAX];
+    struct cec_msg reply = { };
+    unsigned int len;
+
+    len = cec_answer_read(ctx, CEC_ANSWER_OSD_NAME, &reply);
+    if (len > 1) {
+        len = len - 1 < size - 1 ? len - 1 : size - 1;
+        memcpy(name, &reply.msg[2], len);
+        name[len] = '\0';
+        return;
+    }
+
+    property_get("ro.product.model", prop, "");
+    strlcpy(name, prop, size);
+}
+
+static int cec_claim_logical_address(struct hdmicec_context *ctx, cec_logical_address_t addr)
 {
-    struct hdmicec_context *ctx = (struct hdmicec_context *)dev;
     unsigned int la_type = CEC_LOG_ADDR_TYPE_UNREGISTERED;
     unsigned int all_dev_types = 0;
     unsigned int prim_type = 0xff;
     struct cec_log_addrs laddrs;
-    int ret;
+    int ret = 0;
+    int i;
 
     ALOGD("%s: addr:%x\n", __func__, addr);
 
     if (addr >= CEC_ADDR_BROADCAST)
-        return -1;
+        return -EINVAL;
 
-    ret = ioctl(ctx->cec_fd, CEC_ADAP_G_LOG_ADDRS, &laddrs);
-    if (ret)
-        return ret;
     memset(&laddrs, 0, sizeof(laddrs));
 
     laddrs.cec_version = ctx->version;
     laddrs.vendor_id = ctx->vendor_id;
+    cec_osd_name(ctx, laddrs.osd_name, sizeof(laddrs.osd_name));
 
     switch (addr) {
         case CEC_LOG_ADDR_TV:
@@ -131,70 +521,228 @@ static int hdmicec_add_logical_address(const struct hdmi_cec_device *dev, cec_lo
     laddrs.features[0][0] = 0;
     laddrs.features[0][1] = 0;
 
-    ret = ioctl(ctx->cec_fd, CEC_ADAP_S_LOG_ADDRS, &laddrs);
-    if (ret) {
-        ALOGD("%s: %m\n", __func__);
-        return ret;
+    /*
+     * Every port carries the same device, each on its own bus. The legacy
+     * HAL has no callback to report the claim outcome with, so only a
+     * request the kernel rejects outright fails here, -errno of the first
+     * port that rejected it.
+     */
+    for (i = 0; i < ctx->num_adapters; i++) {
+        int err = cec_adapter_claim(ctx, &ctx->adapters[i], &laddrs, addr);
+        if (err && !ret)
+            ret = err;
     }
 
-    ALOGD("%s: log_addr_mask=%x\n", __func__,  laddrs.log_addr_mask);
+    return ret;
+}
 
-    return 0;
+static int hdmicec_add_logical_address(const struct hdmi_cec_device *dev, cec_logical_address_t addr)
+{
+    struct hdmicec_context *ctx = (struct hdmicec_context *)dev;
+
+    // The framework owns the addresses from here, drop any pending boot announcement
+    atomic_store(&ctx->boot_otp_ports, 0);
+
+    return cec_claim_logical_address(ctx, addr);
 }
 
 static void hdmicec_clear_logical_address(const struct hdmi_cec_device *dev)
 {
     struct hdmicec_context *ctx = (struct hdmicec_context *)dev;
     struct cec_log_addrs laddrs;
-    int ret;
+    int i;
+
+    atomic_store(&ctx->boot_otp_ports, 0);
 
     memset(&laddrs, 0, sizeof(laddrs));
-    ret = ioctl(ctx->cec_fd, CEC_ADAP_S_LOG_ADDRS, &laddrs);
-    if (ret)
-        ALOGD("%s: %m\n", __func__);
+    for (i = 0; i < ctx->num_adapters; i++)
+        cec_adapter_claim(ctx, &ctx->adapters[i], &laddrs, CEC_ADDR_UNREGISTERED);
 }
 
 static int hdmicec_get_physical_address(const struct hdmi_cec_device *dev, uint16_t *addr)
 {
     struct hdmicec_context *ctx = (struct hdmicec_context *)dev;
-    int ret = ioctl(ctx->cec_fd, CEC_ADAP_G_PHYS_ADDR, addr);
-    if (ret)
-        ALOGD("%s: %m\n", __func__);
 
-    return ret;
+    *addr = cec_state_phys_addr(atomic_load(&cec_route(ctx, CEC_ADDR_BROADCAST)->state));
+
+    return 0;
 }
 
-static int hdmicec_send_message(const struct hdmi_cec_device *dev, const cec_message_t *msg)
+static int cec_tx_priority(const cec_message_t *msg)
 {
-    struct hdmicec_context *ctx = (struct hdmicec_context *)dev;
-    struct cec_msg cec_msg;
-    int ret;
+    /* Polling messages carry no opcode */
+    if (msg->length == 0)
+        return CEC_TX_PRIO_HIGH;
+
+    switch (msg->body[0]) {
+        case CEC_MESSAGE_FEATURE_ABORT:
+        case CEC_MESSAGE_IMAGE_VIEW_ON:
+        case CEC_MESSAGE_TEXT_VIEW_ON:
+        case CEC_MESSAGE_ACTIVE_SOURCE:
+        case CEC_MESSAGE_INACTIVE_SOURCE:
+        case CEC_MESSAGE_STANDBY:
+        case CEC_MESSAGE_USER_CONTROL_PRESSED:
+        case CEC_MESSAGE_USER_CONTROL_RELEASED:
+        case CEC_MESSAGE_REPORT_PHYSICAL_ADDRESS:
+        case CEC_MESSAGE_REPORT_POWER_STATUS:
+        case CEC_MESSAGE_DEVICE_VENDOR_ID:
+        case CEC_MESSAGE_CEC_VERSION:
+        case CEC_MESSAGE_SET_OSD_NAME:
+        case CEC_MESSAGE_MENU_STATUS:
+        case CEC_MESSAGE_DECK_STATUS:
+            return CEC_TX_PRIO_HIGH;
+        case CEC_MESSAGE_SET_OSD_STRING:
+        case CEC_MESSAGE_VENDOR_COMMAND:
+        case CEC_MESSAGE_VENDOR_COMMAND_WITH_ID:
+            return CEC_TX_PRIO_LOW;
+        default:
+            return CEC_TX_PRIO_NORMAL;
+    }
+}
 
-    pthread_mutex_lock(&ctx->options_lock);
-    bool cec_enabled = ctx->cec_enabled;
-    pthread_mutex_unlock(&ctx->options_lock);
-    if (!cec_enabled) {
-        return HDMI_RESULT_FAIL;
+static uint64_t cec_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline unsigned int cec_stats_slot(const struct cec_msg *msg)
+{
+    return msg->len > 1 ? msg->msg[1] : CEC_STATS_POLL;
+}
+
+static inline void cec_stats_inc(atomic_uint *counter, unsigned int n)
+{
+    atomic_fetch_add_explicit(counter, n, memory_order_relaxed);
+}
+
+static void cec_latency_add(struct cec_latency_hist *hist, uint64_t latency_ns)
+{
+    unsigned long long us = latency_ns / 1000;
+    unsigned long long max;
+    unsigned int i;
+
+    for (i = 0; i < CEC_LATENCY_BUCKETS - 1; i++) {
+        if (us <= cec_latency_bounds_ms[i] * 1000ull)
+            break;
     }
 
-    ALOGD("%s: len=%u\n", __func__, (unsigned int)msg->length);
+    cec_stats_inc(&hist->count[i], 1);
+    cec_stats_inc(&hist->samples, 1);
+    atomic_fetch_add_explicit(&hist->total_us, us, memory_order_relaxed);
+    max = atomic_load_explicit(&hist->max_us, memory_order_relaxed);
+    while (us > max && !atomic_compare_exchange_weak_explicit(&hist->max_us, &max, us,
+                memory_order_relaxed, memory_order_relaxed))
+        ;
+}
 
-    memset(&cec_msg, 0, sizeof(cec_msg));
-    cec_msg.msg[0] = (msg->initiator << 4) | msg->destination;
+/* Accounts a transmit result, latency_ns is 0 if the kernel never took the frame */
+static void cec_stats_tx(struct hdmicec_context *ctx, const struct cec_msg *msg,
+        uint64_t latency_ns)
+{
+    struct cec_opcode_stats *op = &ctx->stats.opcode[cec_stats_slot(msg)];
+    unsigned int attempts_failed;
+
+    cec_stats_inc(&op->tx, 1);
+    if (latency_ns == 0) {
+        cec_stats_inc(&op->tx_error, 1);
+    } else {
+        attempts_failed = msg->tx_arb_lost_cnt + msg->tx_nack_cnt +
+                msg->tx_low_drive_cnt + msg->tx_error_cnt;
+
+        if (msg->tx_status & CEC_TX_STATUS_OK) {
+            cec_stats_inc(&op->tx_ok, 1);
+            cec_stats_inc(&op->tx_retries, attempts_failed);
+        } else {
+            if (msg->tx_status & CEC_TX_STATUS_NACK)
+                cec_stats_inc(&op->tx_nack, 1);
+            else if (msg->tx_status & CEC_TX_STATUS_ARB_LOST)
+                cec_stats_inc(&op->tx_arb_lost, 1);
+            else
+                cec_stats_inc(&op->tx_error, 1);
+            /* The last failed attempt is not a retry */
+            cec_stats_inc(&op->tx_retries, attempts_failed ? attempts_failed - 1 : 0);
+        }
 
-    memcpy(&cec_msg.msg[1], msg->body, msg->length);
-    cec_msg.len = msg->length + 1;
+        cec_latency_add(&ctx->stats.tx_latency, latency_ns);
+    }
 
-    ret = ioctl(ctx->cec_fd, CEC_TRANSMIT, &cec_msg);
-    if (ret) {
-        ALOGD("%s: %m\n", __func__);
-        return HDMI_RESULT_FAIL;
+    if (latency_ns)
+        ATRACE_INT64("CEC tx latency us", latency_ns / 1000);
+}
+
+static void cec_stats_rx(struct hdmicec_context *ctx, const struct cec_msg *msg)
+{
+    cec_stats_inc(&ctx->stats.opcode[cec_stats_slot(msg)].rx, 1);
+}
+
+static void cec_stats_rx_latency(struct hdmicec_context *ctx, uint64_t rx_ts)
+{
+    uint64_t now = cec_now_ns();
+    uint64_t latency_ns = now > rx_ts ? now - rx_ts : 0;
+
+    cec_latency_add(&ctx->stats.rx_latency, latency_ns);
+
+    ATRACE_INT64("CEC rx to callback us", latency_ns / 1000);
+}
+
+/* Only called from event_thread */
+static void cec_trace_add(struct hdmicec_context *ctx, const struct cec_adapter *adap,
+        enum cec_trace_dir dir, uint64_t ts, uint8_t status, const uint8_t *msg, uint8_t len)
+{
+    unsigned int head = atomic_load_explicit(&ctx->stats.trace_head, memory_order_relaxed);
+    struct cec_trace_entry *entry = &ctx->stats.trace[head & (CEC_TRACE_SIZE - 1)];
+    unsigned int seq = atomic_load_explicit(&entry->seq, memory_order_relaxed);
+
+    atomic_store_explicit(&entry->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    entry->rec.ts = ts;
+    entry->rec.pos = head;
+    entry->rec.port = adap->index + 1;
+    entry->rec.dir = dir;
+    entry->rec.status = status;
+    entry->rec.len = len < CEC_MAX_MSG_SIZE ? len : CEC_MAX_MSG_SIZE;
+    memcpy(entry->rec.msg, msg, entry->rec.len);
+    atomic_store_explicit(&entry->seq, seq + 2, memory_order_release);
+    atomic_store_explicit(&ctx->stats.trace_head, head + 1, memory_order_release);
+}
+
+/*
+ * Copies the trace oldest first into records, skipping entries event_thread
+ * overwrote meanwhile. Returns the number of records copied.
+ */
+static unsigned int cec_trace_snapshot(struct hdmicec_context *ctx,
+        struct cec_trace_record *records)
+{
+    unsigned int head = atomic_load_explicit(&ctx->stats.trace_head, memory_order_acquire);
+    unsigned int start = head > CEC_TRACE_SIZE ? head - CEC_TRACE_SIZE : 0;
+    unsigned int count = 0;
+    unsigned int i, seq;
+
+    for (i = start; i != head; i++) {
+        struct cec_trace_entry *entry = &ctx->stats.trace[i & (CEC_TRACE_SIZE - 1)];
+
+        do {
+            seq = atomic_load_explicit(&entry->seq, memory_order_acquire);
+            records[count] = entry->rec;
+            atomic_thread_fence(memory_order_acquire);
+        } while ((seq & 1) || seq != atomic_load_explicit(&entry->seq, memory_order_relaxed));
+
+        if (records[count].pos == i)
+            count++;
     }
 
-    if (cec_msg.tx_status != CEC_TX_STATUS_OK)
-        ALOGD("%s: tx_status=%d\n", __func__, cec_msg.tx_status);
+    return count;
+}
 
-    switch (cec_msg.tx_status) {
+static int cec_tx_result(const struct cec_msg *msg)
+{
+    if (msg->tx_status != CEC_TX_STATUS_OK)
+        ALOGD("%s: tx_status=%d\n", __func__, msg->tx_status);
+
+    switch (msg->tx_status) {
         case CEC_TX_STATUS_OK:
             return HDMI_RESULT_SUCCESS;
         case CEC_TX_STATUS_ARB_LOST:
@@ -202,12 +750,396 @@ static int hdmicec_send_message(const struct hdmi_cec_device *dev, const cec_mes
         case CEC_TX_STATUS_NACK:
             return HDMI_RESULT_NACK;
         default:
-            if (cec_msg.tx_status & CEC_TX_STATUS_NACK)
+            if (msg->tx_status & CEC_TX_STATUS_NACK)
                 return HDMI_RESULT_NACK;
             return HDMI_RESULT_FAIL;
     }
 }
 
+/* Called with tx_lock held */
+static void cec_tx_complete(struct hdmicec_context *ctx, struct cec_tx_request *req, int result)
+{
+    if (req->detached) {
+        free(req);
+        return;
+    }
+
+    req->result = result;
+    req->done = true;
+    pthread_cond_broadcast(&ctx->tx_done_cond);
+}
+
+/* Called with tx_lock held */
+static inline bool cec_adapter_busy(const struct cec_adapter *adap)
+{
+    return adap->tx_inflight != NULL || adap->claim_pending;
+}
+
+/*
+ * Called with tx_lock held. Returns the most urgent request for an adapter
+ * that can take a frame, or any request if all is set.
+ */
+static struct cec_tx_request *cec_tx_dequeue(struct hdmicec_context *ctx, bool all)
+{
+    struct cec_tx_request *prev, *req;
+    int prio;
+
+    for (prio = 0; prio < CEC_TX_PRIO_COUNT; prio++) {
+        for (prev = NULL, req = ctx->tx_head[prio]; req != NULL; prev = req, req = req->next) {
+            if (!all && cec_adapter_busy(req->adap))
+                continue;
+
+            if (prev != NULL)
+                prev->next = req->next;
+            else
+                ctx->tx_head[prio] = req->next;
+            if (ctx->tx_tail[prio] == req)
+                ctx->tx_tail[prio] = prev;
+            req->next = NULL;
+            return req;
+        }
+    }
+
+    return NULL;
+}
+
+/* Called with tx_lock held, returns false if the request was no longer queued */
+static bool cec_tx_unlink(struct hdmicec_context *ctx, struct cec_tx_request *req)
+{
+    struct cec_tx_request *prev, *cur;
+    int prio;
+
+    for (prio = 0; prio < CEC_TX_PRIO_COUNT; prio++) {
+        for (prev = NULL, cur = ctx->tx_head[prio]; cur != NULL; prev = cur, cur = cur->next) {
+            if (cur != req)
+                continue;
+
+            if (prev != NULL)
+                prev->next = cur->next;
+            else
+                ctx->tx_head[prio] = cur->next;
+            if (ctx->tx_tail[prio] == cur)
+                ctx->tx_tail[prio] = prev;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* Completes a background address claim, releasing the held back transmits */
+static void cec_claim_done(struct hdmicec_context *ctx, struct cec_adapter *adap,
+        uint16_t phys_addr, uint16_t log_addr_mask)
+{
+    /*
+     * Releasing the previous addresses also reports an empty mask, a claim
+     * that fails without fallback is left to CEC_CLAIM_TIMEOUT_MS.
+     */
+    if (log_addr_mask == 0 && phys_addr != CEC_PHYS_ADDR_INVALID)
+        return;
+
+    pthread_mutex_lock(&ctx->tx_lock);
+    if (adap->claim_pending) {
+        if (log_addr_mask & (1 << adap->claim_addr))
+            ALOGD("%s: port %d log_addr_mask=%x\n", __func__, adap->index + 1, log_addr_mask);
+        else
+            ALOGE("%s: port %d failed to claim %x, log_addr_mask=%x\n", __func__,
+                    adap->index + 1, adap->claim_addr, log_addr_mask);
+
+        adap->claim_pending = false;
+        pthread_cond_signal(&ctx->tx_cond);
+    }
+    pthread_mutex_unlock(&ctx->tx_lock);
+}
+
+/* Matches a non-blocking transmit result to the in-flight request */
+static void cec_tx_done(struct hdmicec_context *ctx, struct cec_adapter *adap,
+        const struct cec_msg *msg)
+{
+    struct cec_tx_request *req;
+
+    pthread_mutex_lock(&ctx->tx_lock);
+    req = adap->tx_inflight;
+    if (req != NULL && req->msg.sequence == msg->sequence) {
+        adap->tx_inflight = NULL;
+        cec_stats_tx(ctx, msg, cec_now_ns() - req->submit_ns);
+        cec_trace_add(ctx, adap, CEC_TRACE_TX, msg->tx_ts, msg->tx_status,
+                req->msg.msg, req->msg.len);
+        cec_tx_complete(ctx, req, cec_tx_result(msg));
+        pthread_cond_signal(&ctx->tx_cond);
+    } else {
+        ALOGD("%s: unexpected sequence %u\n", __func__, msg->sequence);
+    }
+    pthread_mutex_unlock(&ctx->tx_lock);
+}
+
+/*
+ * Called with tx_lock held. Drops claims that took too long and returns the
+ * earliest deadline of those still pending, or NULL if there are none.
+ */
+static const struct timespec *cec_claim_expire(struct hdmicec_context *ctx)
+{
+    const struct timespec *earliest = NULL;
+    struct timespec now;
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    for (i = 0; i < ctx->num_adapters; i++) {
+        struct cec_adapter *adap = &ctx->adapters[i];
+
+        if (!adap->claim_pending)
+            continue;
+
+        if (now.tv_sec > adap->claim_deadline.tv_sec ||
+                (now.tv_sec == adap->claim_deadline.tv_sec &&
+                 now.tv_nsec >= adap->claim_deadline.tv_nsec)) {
+            ALOGE("%s: port %d timed out claiming %x\n", __func__, adap->index + 1,
+                    adap->claim_addr);
+            adap->claim_pending = false;
+            continue;
+        }
+
+        if (earliest == NULL || adap->claim_deadline.tv_sec < earliest->tv_sec ||
+                (adap->claim_deadline.tv_sec == earliest->tv_sec &&
+                 adap->claim_deadline.tv_nsec < earliest->tv_nsec))
+            earliest = &adap->claim_deadline;
+    }
+
+    return earliest;
+}
+
+static void *tx_thread(void *arg)
+{
+    struct hdmicec_context *ctx = (struct hdmicec_context *)arg;
+    const struct timespec *claim_deadline;
+    struct cec_tx_request *req;
+    int ret;
+    int i;
+
+    ALOGI("%s start!", __func__);
+
+    pthread_mutex_lock(&ctx->tx_lock);
+    while (1) {
+        req = NULL;
+        while (!ctx->tx_exit) {
+            claim_deadline = cec_claim_expire(ctx);
+
+            /* One frame per bus at a time so priorities apply to every slot */
+            if ((req = cec_tx_dequeue(ctx, false)) != NULL)
+                break;
+
+            if (claim_deadline != NULL)
+                pthread_cond_timedwait(&ctx->tx_cond, &ctx->tx_lock, claim_deadline);
+            else
+                pthread_cond_wait(&ctx->tx_cond, &ctx->tx_lock);
+        }
+
+        if (ctx->tx_exit) {
+            if (req != NULL)
+                cec_tx_complete(ctx, req, HDMI_RESULT_FAIL);
+            break;
+        }
+
+        /*
+         * tx_fd is non-blocking, so this returns as soon as the frame is queued
+         * in the kernel; holding tx_lock keeps cec_tx_done() from seeing the
+         * result before the sequence number is known.
+         */
+        req->submit_ns = cec_now_ns();
+        ret = ioctl(req->adap->tx_fd, CEC_TRANSMIT, &req->msg);
+        if (ret) {
+            ALOGD("%s: %m\n", __func__);
+            cec_stats_tx(ctx, &req->msg, 0);
+            cec_tx_complete(ctx, req, HDMI_RESULT_FAIL);
+            continue;
+        }
+
+        req->adap->tx_inflight = req;
+    }
+
+    /* Fail everything still pending so no caller waits forever */
+    for (i = 0; i < ctx->num_adapters; i++) {
+        struct cec_adapter *adap = &ctx->adapters[i];
+
+        if (adap->tx_inflight != NULL) {
+            cec_tx_complete(ctx, adap->tx_inflight, HDMI_RESULT_FAIL);
+            adap->tx_inflight = NULL;
+        }
+    }
+    while ((req = cec_tx_dequeue(ctx, true)) != NULL)
+        cec_tx_complete(ctx, req, HDMI_RESULT_FAIL);
+    pthread_mutex_unlock(&ctx->tx_lock);
+
+    ALOGI("%s exit!", __func__);
+    return NULL;
+}
+
+/* Called with tx_lock held, returns false if the transmit thread is gone */
+static bool cec_tx_enqueue(struct hdmicec_context *ctx, struct cec_tx_request *req, int prio)
+{
+    if (ctx->tx_exit)
+        return false;
+
+    if (ctx->tx_tail[prio] != NULL)
+        ctx->tx_tail[prio]->next = req;
+    else
+        ctx->tx_head[prio] = req;
+    ctx->tx_tail[prio] = req;
+    pthread_cond_signal(&ctx->tx_cond);
+
+    return true;
+}
+
+/* Queues a message originated by the HAL itself, nobody waits for its result */
+static void cec_tx_post(struct hdmicec_context *ctx, struct cec_adapter *adap,
+        const struct cec_msg *msg, int prio)
+{
+    struct cec_tx_request *req;
+
+    req = calloc(1, sizeof(*req));
+    if (!req)
+        return;
+
+    req->adap = adap;
+    req->msg = *msg;
+    req->detached = true;
+
+    pthread_mutex_lock(&ctx->tx_lock);
+    if (!cec_tx_enqueue(ctx, req, prio))
+        free(req);
+    pthread_mutex_unlock(&ctx->tx_lock);
+}
+
+static int cec_answer_slot(int opcode)
+{
+    switch (opcode) {
+        case CEC_MESSAGE_REPORT_PHYSICAL_ADDRESS:
+            return CEC_ANSWER_PHYSICAL_ADDRESS;
+        case CEC_MESSAGE_SET_OSD_NAME:
+            return CEC_ANSWER_OSD_NAME;
+        case CEC_MESSAGE_DEVICE_VENDOR_ID:
+            return CEC_ANSWER_VENDOR_ID;
+        case CEC_MESSAGE_CEC_VERSION:
+            return CEC_ANSWER_CEC_VERSION;
+        default:
+            return -1;
+    }
+}
+
+/* Called with tx_lock held for every message the framework sends */
+static void cec_answer_update(struct hdmicec_context *ctx, const cec_message_t *msg)
+{
+    struct cec_answer_cache *cache = &ctx->answers;
+    unsigned int seq;
+    int slot;
+
+    if (msg->length == 0 || msg->length > sizeof(cache->body[0]))
+        return;
+
+    slot = cec_answer_slot(msg->body[0]);
+    if (slot < 0)
+        return;
+
+    seq = atomic_load_explicit(&cache->seq, memory_order_relaxed);
+    atomic_store_explicit(&cache->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    memcpy(cache->body[slot], msg->body, msg->length);
+    cache->len[slot] = msg->length;
+    atomic_store_explicit(&cache->seq, seq + 2, memory_order_release);
+}
+
+/* Copies a cached reply body into msg, returns its length or 0 if none is cached */
+static unsigned int cec_answer_read(struct hdmicec_context *ctx, int slot, struct cec_msg *msg)
+{
+    struct cec_answer_cache *cache = &ctx->answers;
+    unsigned int seq, len;
+
+    do {
+        seq = atomic_load_explicit(&cache->seq, memory_order_acquire);
+        len = cache->len[slot];
+        memcpy(&msg->msg[1], cache->body[slot], len);
+        atomic_thread_fence(memory_order_acquire);
+    } while ((seq & 1) || seq != atomic_load_explicit(&cache->seq, memory_order_relaxed));
+
+    return len;
+}
+
+static int hdmicec_send_message(const struct hdmi_cec_device *dev, const cec_message_t *msg)
+{
+    struct hdmicec_context *ctx = (struct hdmicec_context *)dev;
+    struct cec_tx_request *req;
+    struct timespec deadline;
+    int prio;
+    int ret;
+    int i;
+
+    unsigned int options = atomic_load_explicit(&ctx->options, memory_order_relaxed);
+    if (!(options & CEC_OPTION_ENABLED)) {
+        return HDMI_RESULT_FAIL;
+    }
+
+    ALOGD("%s: len=%u\n", __func__, (unsigned int)msg->length);
+
+    req = calloc(1, sizeof(*req));
+    if (!req)
+        return HDMI_RESULT_FAIL;
+
+    req->adap = cec_route(ctx, msg->destination);
+    req->msg.msg[0] = (msg->initiator << 4) | msg->destination;
+    memcpy(&req->msg.msg[1], msg->body, msg->length);
+    req->msg.len = msg->length + 1;
+
+    /* Bulk updates are posted, their result only matters to the log */
+    prio = cec_tx_priority(msg);
+    req->detached = prio == CEC_TX_PRIO_LOW;
+
+    /* Broadcasts reach every connected port, the routed one reports the result */
+    if (msg->destination == CEC_ADDR_BROADCAST) {
+        for (i = 0; i < ctx->num_adapters; i++) {
+            struct cec_adapter *adap = &ctx->adapters[i];
+
+            if (adap != req->adap && cec_adapter_connected(adap))
+                cec_tx_post(ctx, adap, &req->msg, prio);
+        }
+    }
+
+    pthread_mutex_lock(&ctx->tx_lock);
+    cec_answer_update(ctx, msg);
+    if (!cec_tx_enqueue(ctx, req, prio)) {
+        pthread_mutex_unlock(&ctx->tx_lock);
+        free(req);
+        return HDMI_RESULT_FAIL;
+    }
+
+    if (req->detached) {
+        pthread_mutex_unlock(&ctx->tx_lock);
+        return HDMI_RESULT_SUCCESS;
+    }
+
+    cec_deadline(&deadline, CEC_TX_TIMEOUT_MS);
+
+    while (!req->done) {
+        if (pthread_cond_timedwait(&ctx->tx_done_cond, &ctx->tx_lock, &deadline) == ETIMEDOUT)
+            break;
+    }
+
+    if (req->done) {
+        ret = req->result;
+        free(req);
+    } else {
+        ALOGD("%s: timed out\n", __func__);
+        if (cec_tx_unlink(ctx, req))
+            free(req);
+        else
+            req->detached = true;
+        ret = HDMI_RESULT_FAIL;
+    }
+    pthread_mutex_unlock(&ctx->tx_lock);
+
+    return ret;
+}
+
 static void hdmicec_register_event_callback(const struct hdmi_cec_device *dev,
         event_callback_t callback, void *arg)
 {
@@ -235,23 +1167,67 @@ static void hdmicec_get_port_info(const struct hdmi_cec_device *dev,
         struct hdmi_port_info *list[], int *total)
 {
     struct hdmicec_context *ctx = (struct hdmicec_context *)dev;
-    int ret;
+    int count = 0;
+    int i;
+
+    for (i = 0; i < ctx->num_adapters; i++) {
+        struct hdmi_port_info *info = &ctx->port_info[count];
+
+        info->type = ctx->type == CEC_DEVICE_TV ? HDMI_INPUT : HDMI_OUTPUT;
+        info->port_id = ctx->adapters[i].index + 1;
+        info->cec_supported = 1;
+        info->arc_supported = 0;
+        info->physical_address = cec_state_phys_addr(atomic_load(&ctx->adapters[i].state));
+
+        ALOGD("type:%s, id:%d, cec support:%d, arc support:%d, physical address:%x",
+                info->type ? "output" : "input",
+                info->port_id,
+                info->cec_supported,
+                info->arc_supported,
+                info->physical_address);
+
+        if (info->physical_address != CEC_PHYS_ADDR_INVALID)
+            count++;
+    }
 
-    ret = ioctl(ctx->cec_fd, CEC_ADAP_G_PHYS_ADDR, &ctx->port_info.physical_address);
-    if (ret)
-        ALOGD("%s: %m\n", __func__);
+    if (count) {
+        *list = ctx->port_info;
+        *total = count;
+    }
+}
+
+/*
+ * Follower mode for the options: passthrough while the framework is in
+ * control, the kernel core answering the discovery queries in standby,
+ * and no follower at all while CEC is off so the kernel feature-aborts
+ * directed messages without waking event_thread.
+ */
+static uint32_t cec_follower_mode(unsigned int options)
+{
+    if (!(options & CEC_OPTION_ENABLED))
+        return CEC_MODE_INITIATOR | CEC_MODE_NO_FOLLOWER;
+
+    if (!(options & CEC_OPTION_CONTROL_ENABLED))
+        return CEC_MODE_INITIATOR | CEC_MODE_EXCL_FOLLOWER;
 
-    ALOGD("type:%s, id:%d, cec support:%d, arc support:%d, physical address:%x",
-            ctx->port_info.type ? "output" : "input",
-            ctx->port_info.port_id,
-            ctx->port_info.cec_supported,
-            ctx->port_info.arc_supported,
-            ctx->port_info.physical_address);
+    return CEC_MODE_INITIATOR | CEC_MODE_EXCL_FOLLOWER_PASSTHRU;
+}
 
-    if (ctx->port_info.physical_address != CEC_PHYS_ADDR_INVALID) {
-        *list = &ctx->port_info;
-        *total = 1;
+static void cec_update_follower_mode(struct hdmicec_context *ctx)
+{
+    uint32_t mode;
+    int ret;
+    int i;
+
+    // Serialized so concurrent option changes cannot apply a stale mode last
+    pthread_mutex_lock(&ctx->tx_lock);
+    mode = cec_follower_mode(atomic_load(&ctx->options));
+    for (i = 0; i < ctx->num_adapters; i++) {
+        ret = ioctl(ctx->adapters[i].cec_fd, CEC_S_MODE, &mode);
+        if (ret)
+            ALOGE("%s: port %d mode %x: %m\n", __func__, ctx->adapters[i].index + 1, mode);
     }
+    pthread_mutex_unlock(&ctx->tx_lock);
 }
 
 static void hdmicec_set_option(const struct hdmi_cec_device *dev, int flag, int value)
@@ -260,17 +1236,21 @@ static void hdmicec_set_option(const struct hdmi_cec_device *dev, int flag, int
     ALOGD("%s: flag=%d, value=%d", __func__, flag, value);
     switch (flag) {
         case HDMI_OPTION_ENABLE_CEC:
-            pthread_mutex_lock(&ctx->options_lock);
-            ctx->cec_enabled = (value == 1 ? true : false);
-            pthread_mutex_unlock(&ctx->options_lock);
+            if (value == 1)
+                atomic_fetch_or(&ctx->options, CEC_OPTION_ENABLED);
+            else
+                atomic_fetch_and(&ctx->options, ~CEC_OPTION_ENABLED);
+            cec_update_follower_mode(ctx);
             break;
         case HDMI_OPTION_WAKEUP:
             // Not valid for playback devices
             break;
         case HDMI_OPTION_SYSTEM_CEC_CONTROL:
-            pthread_mutex_lock(&ctx->options_lock);
-            ctx->cec_control_enabled = (value == 1 ? true : false);
-            pthread_mutex_unlock(&ctx->options_lock);
+            if (value == 1)
+                atomic_fetch_or(&ctx->options, CEC_OPTION_CONTROL_ENABLED);
+            else
+                atomic_fetch_and(&ctx->options, ~CEC_OPTION_CONTROL_ENABLED);
+            cec_update_follower_mode(ctx);
             break;
     }
 }
@@ -278,18 +1258,9 @@ static void hdmicec_set_option(const struct hdmi_cec_device *dev, int flag, int
 static int hdmicec_is_connected(const struct hdmi_cec_device *dev, int port_id)
 {
     struct hdmicec_context *ctx = (struct hdmicec_context *)dev;
-    int ret;
-
-    (void)port_id;
-
-    ret = ioctl(ctx->cec_fd, CEC_ADAP_G_PHYS_ADDR,
-            &ctx->port_info.physical_address);
-    if (ret) {
-        ALOGD("%s: %m\n", __func__);
-        return ret;
-    }
+    struct cec_adapter *adap = cec_adapter_by_port(ctx, port_id);
 
-    if (ctx->port_info.physical_address == CEC_PHYS_ADDR_INVALID)
+    if (adap == NULL || !cec_adapter_connected(adap))
         return false;
 
     return true;
@@ -339,13 +1310,102 @@ static bool is_transferable_in_sleep(struct cec_msg* message) {
     }
 }
 
-static void *event_thread(void *arg)
+/*
+ * Answers discovery queries from the cache while the system is in standby,
+ * so the framework is not woken up just to repeat itself. The kernel core
+ * takes the ones it knows once standby drops passthrough mode, this covers
+ * power status and a failed mode switch. Returns true if the message was
+ * consumed.
+ */
+static bool cec_answer_in_standby(struct hdmicec_context *ctx, struct cec_adapter *adap,
+        const struct cec_msg *msg)
+{
+    uint16_t phys_addr;
+    struct cec_msg reply = { };
+    unsigned int len;
+    int slot;
+
+    /* Only directed queries get an answer */
+    if (msg->len < 2 || cec_msg_destination(msg) == CEC_ADDR_BROADCAST)
+        return false;
+
+    switch (get_opcode((struct cec_msg *)msg)) {
+        case CEC_MESSAGE_GIVE_PHYSICAL_ADDRESS:
+            slot = CEC_ANSWER_PHYSICAL_ADDRESS;
+            break;
+        case CEC_MESSAGE_GIVE_OSD_NAME:
+            slot = CEC_ANSWER_OSD_NAME;
+            break;
+        case CEC_MESSAGE_GIVE_DEVICE_VENDOR_ID:
+            slot = CEC_ANSWER_VENDOR_ID;
+            break;
+        case CEC_MESSAGE_GET_CEC_VERSION:
+            slot = CEC_ANSWER_CEC_VERSION;
+            break;
+        case CEC_MESSAGE_GIVE_DEVICE_POWER_STATUS:
+            /* We only get here in standby, so there is nothing to cache */
+            reply.msg[0] = (cec_msg_destination(msg) << 4) | cec_msg_initiator(msg);
+            reply.msg[1] = CEC_MESSAGE_REPORT_POWER_STATUS;
+            reply.msg[2] = CEC_OP_POWER_STATUS_STANDBY;
+            reply.len = 3;
+            cec_tx_post(ctx, adap, &reply, CEC_TX_PRIO_HIGH);
+            return true;
+        default:
+            return false;
+    }
+
+    len = cec_answer_read(ctx, slot, &reply);
+    if (len == 0)
+        return false;
+
+    /* Each port has its own physical address, only the device type is cached */
+    if (slot == CEC_ANSWER_PHYSICAL_ADDRESS) {
+        phys_addr = cec_state_phys_addr(atomic_load(&adap->state));
+        if (len < 4 || phys_addr == CEC_PHYS_ADDR_INVALID)
+            return false;
+        reply.msg[2] = phys_addr >> 8;
+        reply.msg[3] = phys_addr & 0xff;
+    }
+
+    /* <Report Physical Address> and <Device Vendor ID> are broadcast */
+    if (slot == CEC_ANSWER_PHYSICAL_ADDRESS || slot == CEC_ANSWER_VENDOR_ID)
+        reply.msg[0] = (cec_msg_destination(msg) << 4) | CEC_ADDR_BROADCAST;
+    else
+        reply.msg[0] = (cec_msg_destination(msg) << 4) | cec_msg_initiator(msg);
+    reply.len = len + 1;
+    cec_tx_post(ctx, adap, &reply, CEC_TX_PRIO_HIGH);
+
+    return true;
+}
+
+/* Called from event_thread only, rx_ts is the kernel receive time of a received frame */
+static void cec_event_post(struct hdmicec_context *ctx, const hdmi_event_t *event, uint64_t rx_ts)
+{
+    unsigned int head = atomic_load_explicit(&ctx->rx_ring.head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&ctx->rx_ring.tail, memory_order_acquire);
+    uint64_t tmp = 1;
+
+    if (head - tail >= CEC_EVENT_RING_SIZE) {
+        unsigned int dropped = atomic_fetch_add_explicit(&ctx->rx_dropped, 1,
+                memory_order_relaxed) + 1;
+        ALOGW("%s: dispatch queue full, dropped=%u\n", __func__, dropped);
+        return;
+    }
+
+    ctx->rx_ring.events[head & (CEC_EVENT_RING_SIZE - 1)] = *event;
+    ctx->rx_ring.rx_ts[head & (CEC_EVENT_RING_SIZE - 1)] = rx_ts;
+    atomic_store_explicit(&ctx->rx_ring.head, head + 1, memory_order_release);
+
+    write(ctx->dispatch_fd, &tmp, sizeof(tmp));
+}
+
+static void *dispatch_thread(void *arg)
 {
     struct hdmicec_context *ctx = (struct hdmicec_context *)arg;
+    uint64_t tmp;
     int ret;
-    struct pollfd ufds[3] = {
-        { ctx->cec_fd, POLLIN, 0 },
-        { ctx->cec_fd, POLLERR, 0 },
+    struct pollfd ufds[2] = {
+        { ctx->dispatch_fd, POLLIN, 0 },
         { ctx->exit_fd, POLLIN, 0 },
     };
 
@@ -354,97 +1414,434 @@ static void *event_thread(void *arg)
     while (1) {
         ufds[0].revents = 0;
         ufds[1].revents = 0;
-        ufds[2].revents = 0;
 
-        ret = poll(ufds, 3, -1);
+        ret = poll(ufds, 2, -1);
 
         if (ret <= 0)
             continue;
 
-        if (ufds[2].revents == POLLIN)   /* Exit */
+        if (ufds[1].revents == POLLIN)   /* Exit */
             break;
 
-        if (ufds[1].revents == POLLERR) { /* CEC Event */
-            hdmi_event_t event = { };
-            struct cec_event ev;
+        if (ufds[0].revents != POLLIN)
+            continue;
+
+        read(ctx->dispatch_fd, &tmp, sizeof(tmp));
 
-            ret = ioctl(ctx->cec_fd, CEC_DQEVENT, &ev);
-            if (ret)
-                continue;
+        while (1) {
+            unsigned int tail = atomic_load_explicit(&ctx->rx_ring.tail, memory_order_relaxed);
+            unsigned int head = atomic_load_explicit(&ctx->rx_ring.head, memory_order_acquire);
+            hdmi_event_t event;
+            uint64_t rx_ts;
 
-            pthread_mutex_lock(&ctx->options_lock);
-            bool cec_enabled = ctx->cec_enabled;
-            pthread_mutex_unlock(&ctx->options_lock);
-            if (!cec_enabled) {
-                continue;
-            }
+            if (tail == head)
+                break;
 
-            if (ev.event == CEC_EVENT_STATE_CHANGE) {
-                event.type = HDMI_EVENT_HOT_PLUG;
-                event.dev = &ctx->device;
-                event.hotplug.port_id = 1;
-                if (ev.state_change.phys_addr == CEC_PHYS_ADDR_INVALID)
-                    event.hotplug.connected = false;
-                else
-                    event.hotplug.connected = true;
-
-                if (ctx->p_event_cb != NULL) {
-                    ctx->p_event_cb(&event, ctx->cb_arg);
-                } else {
-                    ALOGE("no event callback for hotplug\n");
-                }
+            event = ctx->rx_ring.events[tail & (CEC_EVENT_RING_SIZE - 1)];
+            rx_ts = ctx->rx_ring.rx_ts[tail & (CEC_EVENT_RING_SIZE - 1)];
+            atomic_store_explicit(&ctx->rx_ring.tail, tail + 1, memory_order_release);
+
+            if (rx_ts)
+                cec_stats_rx_latency(ctx, rx_ts);
+
+            if (ctx->p_event_cb != NULL) {
+                ctx->p_event_cb(&event, ctx->cb_arg);
+            } else {
+                ALOGE("no event callback for %s\n",
+                        event.type == HDMI_EVENT_HOT_PLUG ? "hotplug" : "msg");
             }
         }
+    }
 
-        if (ufds[0].revents == POLLIN) { /* CEC Driver */
-            struct cec_msg msg = { };
-            hdmi_event_t event = { };
+    ALOGI("%s exit!", __func__);
+    return NULL;
+}
 
-            ret = ioctl(ctx->cec_fd, CEC_RECEIVE, &msg);
-            if (ret) {
-                ALOGE("%s: CEC_RECEIVE error (%m)\n", __func__);
-                continue;
-            }
+static void cec_key_arm(struct hdmicec_context *ctx, int interval_ms)
+{
+    struct itimerspec its = { };
 
-            if (msg.rx_status != CEC_RX_STATUS_OK) {
-                ALOGD("%s: rx_status=%d\n", __func__, msg.rx_status);
-                continue;
-            }
+    its.it_interval.tv_sec = interval_ms / 1000;
+    its.it_interval.tv_nsec = (interval_ms % 1000) * 1000000L;
+    its.it_value = its.it_interval;
 
-            pthread_mutex_lock(&ctx->options_lock);
-            bool cec_enabled = ctx->cec_enabled;
-            pthread_mutex_unlock(&ctx->options_lock);
-            if (!cec_enabled) {
-                continue;
+    timerfd_settime(ctx->key_fd, 0, &its, NULL);
+}
+
+static bool cec_key_same(const hdmi_event_t *a, const hdmi_event_t *b)
+{
+    return a->cec.initiator == b->cec.initiator &&
+            a->cec.length == b->cec.length &&
+            !memcmp(a->cec.body, b->cec.body, a->cec.length);
+}
+
+/*
+ * Coalesces the presses a remote repeats while a key is held. The first
+ * press goes through; repeats from the remote only keep the key alive and
+ * cec_key_tick() hands the framework one press per key_repeat_ms instead.
+ * Returns true if the event was consumed.
+ */
+static bool cec_key_filter(struct hdmicec_context *ctx, const hdmi_event_t *event)
+{
+    struct cec_key_state *key = &ctx->key;
+
+    if (ctx->key_repeat_ms <= 0 || event->cec.length < 1 ||
+            event->cec.destination == CEC_ADDR_BROADCAST)
+        return false;
+
+    switch (event->cec.body[0]) {
+        case CEC_MESSAGE_USER_CONTROL_PRESSED:
+            if (key->held && cec_key_same(&key->event, event)) {
+                clock_gettime(CLOCK_MONOTONIC, &key->last_rx);
+                key->repeating = true;
+                return true;
             }
 
-            pthread_mutex_lock(&ctx->options_lock);
-            bool cec_control_enabled = ctx->cec_control_enabled;
-            pthread_mutex_unlock(&ctx->options_lock);
-            if (!cec_control_enabled && !is_transferable_in_sleep(&msg)) {
-                ALOGD("%s: filter message in standby mode\n", __func__);
-                continue;
+            key->held = true;
+            key->repeating = false;
+            key->event = *event;
+            clock_gettime(CLOCK_MONOTONIC, &key->last_rx);
+            cec_key_arm(ctx, ctx->key_repeat_ms);
+            return false;
+        case CEC_MESSAGE_USER_CONTROL_RELEASED:
+            if (key->held && key->event.cec.initiator == event->cec.initiator) {
+                key->held = false;
+                cec_key_arm(ctx, 0);
             }
+            return false;
+        default:
+            return false;
+    }
+}
 
-            if (ctx->p_event_cb != NULL) {
-                event.type = HDMI_EVENT_CEC_MESSAGE;
-                event.dev = &ctx->device;
-                event.cec.initiator = msg.msg[0] >> 4;
-                event.cec.destination = msg.msg[0] & 0xf;
-                event.cec.length = msg.len - 1;
-                memcpy(event.cec.body, &msg.msg[1], msg.len - 1);
+static void cec_key_tick(struct hdmicec_context *ctx)
+{
+    struct cec_key_state *key = &ctx->key;
+    hdmi_event_t event;
+    struct timespec now;
+    uint64_t expirations;
+    long elapsed_ms;
+
+    read(ctx->key_fd, &expirations, sizeof(expirations));
+
+    if (!key->held)
+        return;
+
+    unsigned int options = atomic_load_explicit(&ctx->options, memory_order_relaxed);
+    if (!(options & CEC_OPTION_ENABLED) || !(options & CEC_OPTION_CONTROL_ENABLED)) {
+        key->held = false;
+        cec_key_arm(ctx, 0);
+        return;
+    }
 
-                ctx->p_event_cb(&event, ctx->cb_arg);
-            } else {
-                ALOGE("no event callback for msg\n");
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed_ms = (now.tv_sec - key->last_rx.tv_sec) * 1000 +
+            (now.tv_nsec - key->last_rx.tv_nsec) / 1000000;
+
+    /* The remote went quiet without <User Control Released>, end the press */
+    if (elapsed_ms >= ctx->key_release_ms) {
+        ALOGD("%s: key %x released by timeout\n", __func__,
+                key->event.cec.length > 1 ? key->event.cec.body[1] : 0);
+        event = key->event;
+        event.cec.body[0] = CEC_MESSAGE_USER_CONTROL_RELEASED;
+        event.cec.length = 1;
+        key->held = false;
+        cec_key_arm(ctx, 0);
+        cec_event_post(ctx, &event, 0);
+        return;
+    }
+
+    if (key->repeating)
+        cec_event_post(ctx, &key->event, 0);
+}
+
+static void cec_handle_tx_result(struct hdmicec_context *ctx, struct cec_adapter *adap)
+{
+    struct cec_msg msg = { };
+    int ret;
+
+    ret = ioctl(adap->tx_fd, CEC_RECEIVE, &msg);
+    if (ret == 0)
+        cec_tx_done(ctx, adap, &msg);
+}
+
+/*
+ * Sends <Image View On> and <Active Source> once the boot time claim on
+ * adap succeeded, so the TV switches over before the framework is up.
+ */
+static void cec_boot_one_touch_play(struct hdmicec_context *ctx, struct cec_adapter *adap,
+        uint16_t phys_addr, uint16_t log_addr_mask)
+{
+    unsigned int port = 1u << adap->index;
+    struct cec_msg msg = { };
+    int initiator;
+
+    if (phys_addr == CEC_PHYS_ADDR_INVALID || log_addr_mask == 0)
+        return;
+
+    if (!(atomic_fetch_and(&ctx->boot_otp_ports, ~port) & port))
+        return;
+
+    initiator = __builtin_ctz(log_addr_mask);
+    ALOGI("%s: port %d as %x\n", __func__, adap->index + 1, initiator);
+
+    msg.msg[0] = (initiator << 4) | CEC_ADDR_TV;
+    msg.msg[1] = CEC_MESSAGE_IMAGE_VIEW_ON;
+    msg.len = 2;
+    cec_tx_post(ctx, adap, &msg, CEC_TX_PRIO_HIGH);
+
+    msg.msg[0] = (initiator << 4) | CEC_ADDR_BROADCAST;
+    msg.msg[1] = CEC_MESSAGE_ACTIVE_SOURCE;
+    msg.msg[2] = phys_addr >> 8;
+    msg.msg[3] = phys_addr & 0xff;
+    msg.len = 4;
+    cec_tx_post(ctx, adap, &msg, CEC_TX_PRIO_HIGH);
+}
+
+static void cec_handle_event(struct hdmicec_context *ctx, struct cec_adapter *adap)
+{
+    hdmi_event_t event = { };
+    struct cec_event ev;
+    int ret;
+
+    ret = ioctl(adap->cec_fd, CEC_DQEVENT, &ev);
+    if (ret)
+        return;
+
+    if (ev.event == CEC_EVENT_LOST_MSGS) {
+        unsigned int lost = atomic_fetch_add_explicit(&ctx->rx_lost,
+                ev.lost_msgs.lost_msgs, memory_order_relaxed) + ev.lost_msgs.lost_msgs;
+        ALOGW("%s: kernel receive queue overflow, lost=%u\n", __func__, lost);
+        return;
+    }
+
+    /* Keep the adapter state current even while CEC is disabled */
+    if (ev.event == CEC_EVENT_STATE_CHANGE) {
+        uint8_t state[4] = {
+            ev.state_change.phys_addr >> 8, ev.state_change.phys_addr & 0xff,
+            ev.state_change.log_addr_mask >> 8, ev.state_change.log_addr_mask & 0xff,
+        };
+
+        cec_trace_add(ctx, adap, CEC_TRACE_STATE, ev.ts, 0, state, sizeof(state));
+        atomic_store(&adap->state, cec_state_pack(ev.state_change.phys_addr,
+                ev.state_change.log_addr_mask));
+        if (!cec_adapter_claim_deferred(ctx, adap))
+            cec_claim_done(ctx, adap, ev.state_change.phys_addr,
+                    ev.state_change.log_addr_mask);
+        cec_boot_one_touch_play(ctx, adap, ev.state_change.phys_addr,
+                ev.state_change.log_addr_mask);
+    }
+
+    unsigned int options = atomic_load_explicit(&ctx->options, memory_order_relaxed);
+    if (!(options & CEC_OPTION_ENABLED)) {
+        return;
+    }
+
+    if (ev.event == CEC_EVENT_STATE_CHANGE) {
+        event.type = HDMI_EVENT_HOT_PLUG;
+        event.dev = &ctx->device;
+        event.hotplug.port_id = adap->index + 1;
+        if (ev.state_change.phys_addr == CEC_PHYS_ADDR_INVALID)
+            event.hotplug.connected = false;
+        else
+            event.hotplug.connected = true;
+
+        cec_event_post(ctx, &event, 0);
+    }
+}
+
+static void cec_handle_message(struct hdmicec_context *ctx, struct cec_adapter *adap)
+{
+    struct cec_msg msg = { };
+    hdmi_event_t event = { };
+    int ret;
+
+    ret = ioctl(adap->cec_fd, CEC_RECEIVE, &msg);
+    if (ret) {
+        if (errno != EAGAIN)
+            ALOGE("%s: CEC_RECEIVE error (%m)\n", __func__);
+        return;
+    }
+
+    cec_trace_add(ctx, adap, CEC_TRACE_RX, msg.rx_ts, msg.rx_status, msg.msg, msg.len);
+
+    if (msg.rx_status != CEC_RX_STATUS_OK) {
+        ALOGD("%s: rx_status=%d\n", __func__, msg.rx_status);
+        return;
+    }
+
+    cec_stats_rx(ctx, &msg);
+
+    /* Replies to this device go out on the port it was heard on */
+    if (cec_msg_initiator(&msg) != CEC_ADDR_UNREGISTERED)
+        atomic_store_explicit(&ctx->route[cec_msg_initiator(&msg)], adap->index + 1,
+                memory_order_relaxed);
+
+    unsigned int options = atomic_load_explicit(&ctx->options, memory_order_relaxed);
+    if (!(options & CEC_OPTION_ENABLED)) {
+        return;
+    }
+
+    if (!(options & CEC_OPTION_CONTROL_ENABLED)) {
+        if (cec_answer_in_standby(ctx, adap, &msg)) {
+            ALOGD("%s: answered message in standby mode\n", __func__);
+            return;
+        }
+
+        if (!is_transferable_in_sleep(&msg)) {
+            ALOGD("%s: filter message in standby mode\n", __func__);
+            return;
+        }
+    }
+
+    event.type = HDMI_EVENT_CEC_MESSAGE;
+    event.dev = &ctx->device;
+    event.cec.initiator = msg.msg[0] >> 4;
+    event.cec.destination = msg.msg[0] & 0xf;
+    event.cec.length = msg.len - 1;
+    memcpy(event.cec.body, &msg.msg[1], msg.len - 1);
+
+    if (cec_key_filter(ctx, &event))
+        return;
+
+    cec_event_post(ctx, &event, msg.rx_ts);
+}
+
+static void *event_thread(void *arg)
+{
+    struct hdmicec_context *ctx = (struct hdmicec_context *)arg;
+    struct epoll_event events[CEC_MAX_ADAPTERS * 2 + 2];
+    int nfds;
+    int i;
+
+    ALOGI("%s start!", __func__);
+
+    while (1) {
+        nfds = epoll_wait(ctx->epoll_fd, events, sizeof(events) / sizeof(events[0]), -1);
+
+        if (nfds <= 0)
+            continue;
+
+        for (i = 0; i < nfds; i++) {
+            struct cec_adapter *adap = &ctx->adapters[events[i].data.u32 >> 8];
+
+            switch (events[i].data.u32 & 0xff) {
+                case CEC_POLL_EXIT:
+                    goto exit;
+                case CEC_POLL_KEY: /* Key repeat */
+                    cec_key_tick(ctx);
+                    break;
+                case CEC_POLL_TX: /* CEC transmit result */
+                    if (events[i].events & EPOLLIN)
+                        cec_handle_tx_result(ctx, adap);
+                    break;
+                case CEC_POLL_ADAPTER:
+                    if (events[i].events & EPOLLPRI) /* CEC Event */
+                        cec_handle_event(ctx, adap);
+                    if (events[i].events & EPOLLIN)  /* CEC Driver */
+                        cec_handle_message(ctx, adap);
+                    break;
             }
         }
     }
 
+exit:
     ALOGI("%s exit!", __func__);
     return NULL;
 }
 
+static void cec_dump_latency(int fd, const char *name, struct cec_latency_hist *hist)
+{
+    unsigned int samples = atomic_load_explicit(&hist->samples, memory_order_relaxed);
+    unsigned long long total_us = atomic_load_explicit(&hist->total_us, memory_order_relaxed);
+    unsigned int i, count;
+
+    dprintf(fd, "%s: samples=%u avg=%lluus max=%lluus\n", name, samples,
+            samples ? total_us / samples : 0ull,
+            atomic_load_explicit(&hist->max_us, memory_order_relaxed));
+
+    for (i = 0; i < CEC_LATENCY_BUCKETS; i++) {
+        count = atomic_load_explicit(&hist->count[i], memory_order_relaxed);
+        if (i < CEC_LATENCY_BUCKETS - 1)
+            dprintf(fd, "  <=%4ums: %u\n", cec_latency_bounds_ms[i], count);
+        else
+            dprintf(fd, "  > %4ums: %u\n", cec_latency_bounds_ms[i - 1], count);
+    }
+}
+
+/*
+ * One line per entry, oldest first, so a capture can be fed back to a
+ * test adapter: <ts ns> <port> <rx|tx|state> <status> <bytes>
+ */
+static void cec_dump_trace(int fd, const struct cec_trace_record *records, unsigned int count)
+{
+    static const char *const dir_names[] = { "rx", "tx", "state" };
+    unsigned int i, j;
+
+    dprintf(fd, "bus trace (%u entries):\n", count);
+    for (i = 0; i < count; i++) {
+        const struct cec_trace_record *entry = &records[i];
+
+        dprintf(fd, "  %llu %u %s %02x ", (unsigned long long)entry->ts, entry->port,
+                dir_names[entry->dir], entry->status);
+        for (j = 0; j < entry->len; j++)
+            dprintf(fd, j ? ":%02x" : "%02x", entry->msg[j]);
+        dprintf(fd, "\n");
+    }
+}
+
+static void hdmicec_dump(const struct hdmi_cec_device *dev, int fd)
+{
+    struct hdmicec_context *ctx = (struct hdmicec_context *)dev;
+    struct cec_trace_record *records;
+    unsigned int state;
+    unsigned int i;
+
+    dprintf(fd, "options=%x rx_dropped=%u rx_lost=%u\n",
+            atomic_load(&ctx->options), atomic_load(&ctx->rx_dropped),
+            atomic_load(&ctx->rx_lost));
+
+    for (i = 0; i < (unsigned int)ctx->num_adapters; i++) {
+        state = atomic_load(&ctx->adapters[i].state);
+        dprintf(fd, "port %d: physical_address=%x log_addr_mask=%x\n",
+                ctx->adapters[i].index + 1, cec_state_phys_addr(state),
+                cec_state_log_addr_mask(state));
+    }
+
+    dprintf(fd, "opcode      tx      ok    nack arblost   error retries      rx\n");
+    for (i = 0; i <= CEC_STATS_POLL; i++) {
+        struct cec_opcode_stats *op = &ctx->stats.opcode[i];
+        unsigned int tx = atomic_load_explicit(&op->tx, memory_order_relaxed);
+        unsigned int rx = atomic_load_explicit(&op->rx, memory_order_relaxed);
+
+        if (tx == 0 && rx == 0)
+            continue;
+
+        if (i == CEC_STATS_POLL)
+            dprintf(fd, "poll  ");
+        else
+            dprintf(fd, "0x%02x  ", i);
+        dprintf(fd, "%8u%8u%8u%8u%8u%8u%8u\n", tx,
+                atomic_load_explicit(&op->tx_ok, memory_order_relaxed),
+                atomic_load_explicit(&op->tx_nack, memory_order_relaxed),
+                atomic_load_explicit(&op->tx_arb_lost, memory_order_relaxed),
+                atomic_load_explicit(&op->tx_error, memory_order_relaxed),
+                atomic_load_explicit(&op->tx_retries, memory_order_relaxed), rx);
+    }
+
+    cec_dump_latency(fd, "tx latency (transmit to result)", &ctx->stats.tx_latency);
+    cec_dump_latency(fd, "rx latency (receive to callback)", &ctx->stats.rx_latency);
+
+    /* Snapshot first, writing to fd can block and event_thread keeps tracing meanwhile */
+    records = malloc(CEC_TRACE_SIZE * sizeof(*records));
+    if (!records)
+        return;
+
+    cec_dump_trace(fd, records, cec_trace_snapshot(ctx, records));
+
+    free(records);
+}
+
 static void hdmicec_set_arc(const struct hdmi_cec_device *dev, int port_id, int flag)
 {
     (void)dev;
@@ -457,34 +1854,60 @@ static int hdmicec_close(struct hdmi_cec_device *dev)
 {
     struct hdmicec_context *ctx = (struct hdmicec_context *)dev;
     uint64_t tmp = 1;
+    int i;
 
     ALOGD("%s\n", __func__);
 
+    /* Only join the threads open_hdmi_cec got to start */
     if (ctx->exit_fd > 0) {
         write(ctx->exit_fd, &tmp, sizeof(tmp));
-        pthread_join(ctx->thread, NULL);
+        if (ctx->thread_started)
+            pthread_join(ctx->thread, NULL);
+        if (ctx->dispatch_thread_started)
+            pthread_join(ctx->dispatch_thread, NULL);
     }
 
-    if (ctx->cec_fd > 0)
-        close(ctx->cec_fd);
+    if (ctx->tx_thread_started) {
+        pthread_mutex_lock(&ctx->tx_lock);
+        ctx->tx_exit = true;
+        pthread_cond_signal(&ctx->tx_cond);
+        pthread_mutex_unlock(&ctx->tx_lock);
+        pthread_join(ctx->tx_thread, NULL);
+    }
+
+    for (i = 0; i < ctx->num_adapters; i++) {
+        if (ctx->adapters[i].cec_fd > 0)
+            close(ctx->adapters[i].cec_fd);
+        if (ctx->adapters[i].tx_fd > 0)
+            close(ctx->adapters[i].tx_fd);
+    }
+    if (ctx->epoll_fd > 0)
+        close(ctx->epoll_fd);
+    if (ctx->key_fd > 0)
+        close(ctx->key_fd);
     if (ctx->exit_fd > 0)
         close(ctx->exit_fd);
+    if (ctx->dispatch_fd > 0)
+        close(ctx->dispatch_fd);
+    pthread_cond_destroy(&ctx->tx_done_cond);
+    pthread_cond_destroy(&ctx->tx_cond);
+    pthread_mutex_destroy(&ctx->tx_lock);
+    pthread_mutex_destroy(&ctx->claim_lock);
     free(ctx);
 
-    ctx->cec_enabled = false;
-    ctx->cec_control_enabled = false;
     return 0;
 }
 
-static int cec_init(struct hdmicec_context *ctx)
+static int cec_adapter_init(struct cec_adapter *adap)
 {
     struct cec_log_addrs laddrs = {};
     struct cec_caps caps = {};
+    uint16_t phys_addr;
     uint32_t mode;
     int ret;
 
     // Ensure the CEC device supports required capabilities
-    ret = ioctl(ctx->cec_fd, CEC_ADAP_G_CAPS, &caps);
+    ret = ioctl(adap->cec_fd, CEC_ADAP_G_CAPS, &caps);
     if (ret)
         return ret;
 
@@ -498,10 +1921,38 @@ static int cec_init(struct hdmicec_context *ctx)
 
     // This is an exclusive follower, in addition put the CEC device into passthrough mode
     mode = CEC_MODE_INITIATOR | CEC_MODE_EXCL_FOLLOWER_PASSTHRU;
-    ret = ioctl(ctx->cec_fd, CEC_S_MODE, &mode);
+    ret = ioctl(adap->cec_fd, CEC_S_MODE, &mode);
     if (ret)
         return ret;
 
+    // The transmit handle only initiates, its CEC_RECEIVE queue carries our transmit results
+    mode = CEC_MODE_INITIATOR | CEC_MODE_NO_FOLLOWER;
+    ret = ioctl(adap->tx_fd, CEC_S_MODE, &mode);
+    if (ret)
+        return ret;
+
+    memset(&laddrs, 0, sizeof(laddrs));
+    ret = ioctl(adap->cec_fd, CEC_ADAP_S_LOG_ADDRS, &laddrs);
+    if (ret)
+        return ret;
+
+    // Seed the adapter state cache, CEC_EVENT_STATE_CHANGE keeps it current afterwards
+    ret = ioctl(adap->cec_fd, CEC_ADAP_G_PHYS_ADDR, &phys_addr);
+    if (ret)
+        return ret;
+    atomic_store(&adap->state, cec_state_pack(phys_addr, 0));
+
+    ALOGD("%s: port %d physical address %x\n", __func__, adap->index + 1, phys_addr);
+
+    return ret;
+}
+
+static int cec_init(struct hdmicec_context *ctx)
+{
+    struct epoll_event ev = { .events = EPOLLIN };
+    int ret;
+    int i;
+
     ctx->type = property_get_int32("ro.hdmi.device_type", CEC_DEVICE_PLAYBACK);
 
     ctx->vendor_id = property_get_int32("ro.hdmi.vendor_id",
@@ -510,34 +1961,103 @@ static int cec_init(struct hdmicec_context *ctx)
     ctx->version = property_get_bool("ro.hdmi.cec_version",
             CEC_OP_CEC_VERSION_1_4);
 
-    ctx->port_info.type = ctx->type == CEC_DEVICE_TV ? HDMI_INPUT : HDMI_OUTPUT;
-    ctx->port_info.port_id = 1;
-    ctx->port_info.cec_supported = 1;
-    ctx->port_info.arc_supported = 0;
-
     ALOGD("%s: type=%d\n", __func__, ctx->type);
     ALOGD("%s: vendor_id=%04x\n", __func__, ctx->vendor_id);
+    /*
+     * Off unless set. Held keys reach the framework once per window, so only
+     * a window at least as long as the remote's own repeat period (about
+     * 200-450 ms) cuts callbacks, a shorter one adds synthesised presses.
+     */
+    ctx->key_repeat_ms = property_get_int32("ro.hdmi.cec_key_repeat_ms", 0);
+    ctx->key_release_ms = property_get_int32("ro.hdmi.cec_key_release_ms", CEC_KEY_RELEASE_MS);
+
     ALOGD("%s: version=%d\n", __func__, ctx->version);
+    ALOGD("%s: key_repeat_ms=%d key_release_ms=%d\n", __func__,
+            ctx->key_repeat_ms, ctx->key_release_ms);
 
-    memset(&laddrs, 0, sizeof(laddrs));
-    ret = ioctl(ctx->cec_fd, CEC_ADAP_S_LOG_ADDRS, &laddrs);
+    // One event loop covers every adapter, its transmit handle and the exit eventfd
+    ctx->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (ctx->epoll_fd < 0)
+        return -1;
+
+    ev.data.u32 = CEC_POLL_DATA(0, CEC_POLL_EXIT);
+    ret = epoll_ctl(ctx->epoll_fd, EPOLL_CTL_ADD, ctx->exit_fd, &ev);
+    if (ret)
+        return ret;
+
+    ctx->key_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (ctx->key_fd < 0)
+        return -1;
+
+    ev.data.u32 = CEC_POLL_DATA(0, CEC_POLL_KEY);
+    ret = epoll_ctl(ctx->epoll_fd, EPOLL_CTL_ADD, ctx->key_fd, &ev);
     if (ret)
         return ret;
 
-    pthread_mutex_init(&ctx->options_lock, NULL);
+    for (i = 0; i < ctx->num_adapters; i++) {
+        ev.events = EPOLLIN | EPOLLPRI;
+        ev.data.u32 = CEC_POLL_DATA(i, CEC_POLL_ADAPTER);
+        ret = epoll_ctl(ctx->epoll_fd, EPOLL_CTL_ADD, ctx->adapters[i].cec_fd, &ev);
+        if (ret)
+            return ret;
+
+        ev.events = EPOLLIN;
+        ev.data.u32 = CEC_POLL_DATA(i, CEC_POLL_TX);
+        ret = epoll_ctl(ctx->epoll_fd, EPOLL_CTL_ADD, ctx->adapters[i].tx_fd, &ev);
+        if (ret)
+            return ret;
+    }
 
-    ALOGD("%s: initialized CEC controller\n", __func__);
+    ALOGD("%s: initialized %d CEC controller(s)\n", __func__, ctx->num_adapters);
 
-    return ret;
+    return 0;
+}
+
+/* Opens and sets up one adapter, the device list is ro.hdmi.cec_device */
+static int cec_adapter_open(struct hdmicec_context *ctx, const char *name, int index)
+{
+    struct cec_adapter *adap = &ctx->adapters[ctx->num_adapters];
+    char path[32];
+
+    snprintf(path, sizeof(path), "/dev/%s", name);
+
+    /* Non-blocking, address claims complete through CEC_EVENT_STATE_CHANGE */
+    adap->cec_fd = open(path, O_RDWR | O_NONBLOCK);
+    if (adap->cec_fd < 0) {
+        ALOGE("faild to open %s, ret=%s\n", path, strerror(errno));
+        return -1;
+    }
+
+    /* Separate non-blocking handle so transmits never wait for the bus */
+    adap->tx_fd = open(path, O_RDWR | O_NONBLOCK);
+    if (adap->tx_fd < 0) {
+        ALOGE("faild to open %s, ret=%s\n", path, strerror(errno));
+        close(adap->cec_fd);
+        return -1;
+    }
+
+    adap->index = index;
+    if (cec_adapter_init(adap)) {
+        ALOGE("faild to init %s\n", path);
+        close(adap->cec_fd);
+        close(adap->tx_fd);
+        memset(adap, 0, sizeof(*adap));
+        return -1;
+    }
+
+    ctx->num_adapters++;
+    return 0;
 }
 
 static int open_hdmi_cec(const struct hw_module_t *module, const char *id,
         struct hw_device_t **device)
 {
-    char path[32];
     char prop[PROPERTY_VALUE_MAX];
+    char *name, *saveptr;
     hdmicec_context_t *ctx;
+    int index = 0;
     int ret;
+    int i;
 
     ALOGD("%s: id=%s\n", __func__, id);
 
@@ -547,12 +2067,34 @@ static int open_hdmi_cec(const struct hw_module_t *module, const char *id,
 
     memset(ctx, 0, sizeof(*ctx));
 
-    property_get("ro.hdmi.cec_device", prop, "cec0");
-    snprintf(path, sizeof(path), "/dev/%s", prop);
+    pthread_mutex_init(&ctx->claim_lock, NULL);
+    pthread_mutex_init(&ctx->tx_lock, NULL);
+    {
+        pthread_condattr_t attr;
 
-    ctx->cec_fd = open(path, O_RDWR);
-    if (ctx->cec_fd < 0) {
-        ALOGE("faild to open %s, ret=%s\n", path, strerror(errno));
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&ctx->tx_cond, &attr);
+        pthread_cond_init(&ctx->tx_done_cond, &attr);
+        pthread_condattr_destroy(&attr);
+    }
+
+    /*
+     * Comma separated, the position in the list is the port id. A device
+     * that fails to open leaves its port id unused rather than renumbering
+     * the ports after it.
+     */
+    if (id != NULL && !strncmp(id, HDMI_CEC_RPI_INTERFACE_DEVICES,
+                strlen(HDMI_CEC_RPI_INTERFACE_DEVICES)))
+        strlcpy(prop, id + strlen(HDMI_CEC_RPI_INTERFACE_DEVICES), sizeof(prop));
+    else
+        property_get("ro.hdmi.cec_device", prop, "cec0");
+    for (name = strtok_r(prop, ",", &saveptr); name != NULL && index < CEC_MAX_ADAPTERS;
+            name = strtok_r(NULL, ",", &saveptr))
+        cec_adapter_open(ctx, name, index++);
+
+    if (ctx->num_adapters == 0) {
+        errno = ENODEV;
         goto fail;
     }
 
@@ -562,6 +2104,12 @@ static int open_hdmi_cec(const struct hw_module_t *module, const char *id,
         goto fail;
     }
 
+    ctx->dispatch_fd = eventfd(0, EFD_NONBLOCK);
+    if (ctx->dispatch_fd < 0) {
+        ALOGE("faild to open eventfd, ret = %d\n", errno);
+        goto fail;
+    }
+
     ctx->device.common.tag = HARDWARE_DEVICE_TAG;
     ctx->device.common.version = HDMI_CEC_DEVICE_API_VERSION_1_0;
     ctx->device.common.module = (struct hw_module_t *)module;
@@ -586,14 +2134,41 @@ static int open_hdmi_cec(const struct hw_module_t *module, const char *id,
 
     *device = &ctx->device.common;
 
+    /* thread loop for handing received events to the framework */
+    if (pthread_create(&ctx->dispatch_thread, NULL, dispatch_thread, ctx)) {
+        ALOGE("Can't create dispatch thread: %s\n", strerror(errno));
+        goto fail;
+    }
+    ctx->dispatch_thread_started = true;
+
     /* thread loop for receiving cec msg */
     if (pthread_create(&ctx->thread, NULL, event_thread, ctx)) {
         ALOGE("Can't create event thread: %s\n", strerror(errno));
         goto fail;
     }
+    ctx->thread_started = true;
+
+    /* thread loop for transmitting queued cec msg */
+    if (pthread_create(&ctx->tx_thread, NULL, tx_thread, ctx)) {
+        ALOGE("Can't create tx thread: %s\n", strerror(errno));
+        goto fail;
+    }
+    ctx->tx_thread_started = true;
+
+    atomic_store(&ctx->options, CEC_OPTION_ENABLED | CEC_OPTION_CONTROL_ENABLED);
+
+    /*
+     * Opt-in: claim a playback address and ask the TV to switch to us right
+     * away instead of waiting for HdmiControlService. The framework's first
+     * add/clear_logical_address takes over and cancels what has not gone out.
+     */
+    if (property_get_bool("ro.hdmi.cec_boot_one_touch_play", false) &&
+            ctx->type == CEC_DEVICE_PLAYBACK) {
+        for (i = 0; i < ctx->num_adapters; i++)
+            atomic_fetch_or(&ctx->boot_otp_ports, 1u << ctx->adapters[i].index);
+        cec_claim_logical_address(ctx, CEC_ADDR_PLAYBACK_1);
+    }
 
-    ctx->cec_enabled = true;
-    ctx->cec_control_enabled = true;
     return 0;
 
 fail:
@@ -607,12 +2182,15 @@ static struct hw_module_methods_t hdmi_cec_module_methods = {
 };
 
 /* hdmi_cec module */
-struct hw_module_t HAL_MODULE_INFO_SYM = {
-    .tag = HARDWARE_MODULE_TAG,
-    .version_major = 1,
-    .version_minor = 0,
-    .id = HDMI_CEC_HARDWARE_MODULE_ID,
-    .name = "Raspberry Pi HDMI CEC HAL",
-    .author = "The Android Open Source Project",
-    .methods = &hdmi_cec_module_methods,
+hdmi_cec_rpi_module_t HAL_MODULE_INFO_SYM = {
+    .common = {
+        .tag = HARDWARE_MODULE_TAG,
+        .version_major = 1,
+        .version_minor = 0,
+        .id = HDMI_CEC_HARDWARE_MODULE_ID,
+        .name = HDMI_CEC_RPI_MODULE_NAME,
+        .author = "The Android Open Source Project",
+        .methods = &hdmi_cec_module_methods,
+    },
+    .dump = hdmicec_dump,
 };
@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2021-2022 KonstaKANG
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef HDMI_CEC_RPI_H
+#define HDMI_CEC_RPI_H
+
+#include <sys/cdefs.h>
+
+#include <hardware/hdmi_cec.h>
+
+__BEGIN_DECLS
+
+#define HDMI_CEC_RPI_MODULE_NAME "Raspberry Pi HDMI CEC HAL"
+
+/*
+ * Device id prefix for hw_module_methods_t.open(). The comma separated
+ * adapters after it, e.g. HDMI_CEC_RPI_INTERFACE_DEVICES "cec2", are used
+ * instead of ro.hdmi.cec_device. Lets a test run the HAL against vivid.
+ */
+#define HDMI_CEC_RPI_INTERFACE_DEVICES HDMI_CEC_HARDWARE_INTERFACE ":"
+
+/*
+ * Module exported by hdmi_cec.rpi. Callers that found the module through
+ * hw_get_module() check common.name against HDMI_CEC_RPI_MODULE_NAME
+ * before using the extensions.
+ */
+typedef struct hdmi_cec_rpi_module {
+    struct hw_module_t common;
+
+    /*
+     * Writes adapter state and bus statistics to fd as text, for
+     * dumpsys/lshal debug.
+     */
+    void (*dump)(const struct hdmi_cec_device *dev, int fd);
+} hdmi_cec_rpi_module_t;
+
+__END_DECLS
+
+#endif // HDMI_CEC_RPI_H
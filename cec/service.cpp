@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ * Copyright (C) 2024 KonstaKANG
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "android.hardware.tv.hdmi.cec-service.rpi"
+
+#include "HdmiCec.h"
+
+#include <android-base/logging.h>
+#include <android/binder_manager.h>
+#include <android/binder_process.h>
+#include <string.h>
+
+using ::aidl::android::hardware::tv::hdmi::HdmiCec;
+using ::aidl::android::hardware::tv::hdmi::HdmiConnection;
+
+int main() {
+    const hw_module_t* module = nullptr;
+    hdmi_cec_device_t* device = nullptr;
+
+    // Load hdmi_cec.rpi in process, its callbacks feed the binder callbacks directly
+    int ret = hw_get_module(HDMI_CEC_HARDWARE_MODULE_ID, &module);
+    CHECK(ret == 0) << "Failed to load " << HDMI_CEC_HARDWARE_MODULE_ID << ": " << ret;
+    CHECK(strcmp(module->name, HDMI_CEC_RPI_MODULE_NAME) == 0) << "Unexpected module " << module->name;
+
+    ret = hdmi_cec_open(module, &device);
+    CHECK(ret == 0) << "Failed to open " << HDMI_CEC_HARDWARE_INTERFACE << ": " << ret;
+
+    // sendMessage can block for the transmit timeout, keep the cached getters answering meanwhile
+    ABinderProcess_setThreadPoolMaxThreadCount(4);
+    ABinderProcess_startThreadPool();
+
+    std::shared_ptr<HdmiConnection> connection = ndk::SharedRefBase::make<HdmiConnection>(device);
+    std::shared_ptr<HdmiCec> hdmiCec = ndk::SharedRefBase::make<HdmiCec>(
+            reinterpret_cast<const hdmi_cec_rpi_module_t*>(module), device, connection);
+
+    const std::string connectionInstance = std::string() + HdmiConnection::descriptor + "/default";
+    binder_status_t status = AServiceManager_addService(connection->asBinder().get(),
+            connectionInstance.c_str());
+    CHECK(status == STATUS_OK);
+
+    const std::string cecInstance = std::string() + HdmiCec::descriptor + "/default";
+    status = AServiceManager_addService(hdmiCec->asBinder().get(), cecInstance.c_str());
+    CHECK(status == STATUS_OK);
+
+    ABinderProcess_joinThreadPool();
+    return EXIT_FAILURE;  // should not reached
+}
@@ -0,0 +1,433 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Replay and load rig for hdmi_cec.rpi against vivid's virtual CEC bus.
+ *
+ * The HAL drives vivid's HDMI output adapter while the rig plays the TV on
+ * vivid's HDMI input adapter, so frames cross a real kernel CEC core with
+ * emulated bus timing. Each scenario reports throughput, drops and latency
+ * and fails on lost frames. Load vivid first, its defaults give one HDMI
+ * input and one HDMI output:
+ *
+ *   modprobe vivid
+ *
+ * A bus trace from the HAL's dump is replayed with
+ * CEC_REPLAY_TRACE=<file>, CEC_REPLAY_SPEED scales its timing (0 sends as
+ * fast as the bus allows).
+ */
+
+#include "hdmi_cec_rpi.h"
+
+#include <android-base/file.h>
+#include <android-base/strings.h>
+#include <android-base/unique_fd.h>
+#include <fcntl.h>
+#include <gtest/gtest.h>
+#include <linux/cec.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+extern "C" hdmi_cec_rpi_module_t HAL_MODULE_INFO_SYM;
+
+namespace {
+
+using ::android::base::ReadFdToString;
+using ::android::base::ReadFileToString;
+using ::android::base::Split;
+using ::android::base::StartsWith;
+using ::android::base::unique_fd;
+
+// Upper bound for a frame from the TV to reach the HAL callback
+constexpr uint64_t kMaxP99LatencyUs = 100000;
+
+constexpr auto kClaimTimeout = std::chrono::seconds(5);
+constexpr auto kDeliveryTimeout = std::chrono::seconds(2);
+
+uint64_t nowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+struct VividBus {
+    std::string playback;  // vivid-NNN-vid-out0, driven by the HAL
+    std::string tv;        // vivid-NNN-vid-cap0, driven by the rig
+};
+
+std::optional<VividBus> findVividBus() {
+    std::vector<std::pair<std::string, std::string>> adapters;  // device, adapter name
+
+    for (int i = 0; i < 16; i++) {
+        std::string dev = "cec" + std::to_string(i);
+        unique_fd fd(open(("/dev/" + dev).c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC));
+        struct cec_caps caps = {};
+
+        if (fd < 0 || ioctl(fd, CEC_ADAP_G_CAPS, &caps) || strcmp(caps.driver, "vivid"))
+            continue;
+        adapters.emplace_back(dev, caps.name);
+    }
+
+    for (const auto& [out, outName] : adapters) {
+        size_t pos = outName.find("-vid-out");
+        if (pos == std::string::npos) continue;
+
+        // The output is wired to the first HDMI input of the same instance
+        for (const auto& [cap, capName] : adapters) {
+            if (StartsWith(capName, outName.substr(0, pos) + "-vid-cap"))
+                return VividBus{out, cap};
+        }
+    }
+
+    return std::nullopt;
+}
+
+uint64_t percentileUs(std::vector<uint64_t> samples, double pct) {
+    if (samples.empty()) return 0;
+    std::sort(samples.begin(), samples.end());
+    size_t idx = std::min(samples.size() - 1, static_cast<size_t>(samples.size() * pct / 100));
+    return samples[idx];
+}
+
+struct ScenarioResult {
+    unsigned sent = 0;
+    unsigned delivered = 0;
+    std::vector<uint64_t> latencyUs;
+    uint64_t elapsedNs = 0;
+};
+
+class HdmiCecReplayTest : public ::testing::Test {
+  protected:
+    void SetUp() override {
+        std::optional<VividBus> bus = findVividBus();
+        if (!bus) GTEST_SKIP() << "no vivid CEC adapters, modprobe vivid";
+
+        mPlaybackFd.reset(open(("/dev/" + bus->playback).c_str(), O_RDWR | O_CLOEXEC));
+        ASSERT_GE(mPlaybackFd, 0);
+
+        // Blocking, so transmits return with their result and reply
+        mTvFd.reset(open(("/dev/" + bus->tv).c_str(), O_RDWR | O_CLOEXEC));
+        ASSERT_GE(mTvFd, 0);
+
+        uint32_t mode = CEC_MODE_INITIATOR | CEC_MODE_FOLLOWER;
+        ASSERT_EQ(0, ioctl(mTvFd, CEC_S_MODE, &mode)) << strerror(errno);
+
+        struct cec_log_addrs laddrs = {};
+        ASSERT_EQ(0, ioctl(mTvFd, CEC_ADAP_S_LOG_ADDRS, &laddrs)) << strerror(errno);
+        laddrs.cec_version = CEC_OP_CEC_VERSION_1_4;
+        laddrs.num_log_addrs = 1;
+        laddrs.log_addr_type[0] = CEC_LOG_ADDR_TYPE_TV;
+        laddrs.primary_device_type[0] = CEC_OP_PRIM_DEVTYPE_TV;
+        laddrs.all_device_types[0] = CEC_OP_ALL_DEVTYPE_TV;
+        strcpy(laddrs.osd_name, "Replay TV");
+        ASSERT_EQ(0, ioctl(mTvFd, CEC_ADAP_S_LOG_ADDRS, &laddrs)) << strerror(errno);
+        ASSERT_EQ(CEC_LOG_ADDR_TV, laddrs.log_addr[0]);
+
+        const hw_module_t* module = &HAL_MODULE_INFO_SYM.common;
+        std::string id = HDMI_CEC_RPI_INTERFACE_DEVICES + bus->playback;
+        hw_device_t* device = nullptr;
+        ASSERT_EQ(0, module->methods->open(module, id.c_str(), &device));
+        mDevice = reinterpret_cast<hdmi_cec_device_t*>(device);
+        mDevice->register_event_callback(mDevice, &HdmiCecReplayTest::onEvent, this);
+
+        ASSERT_EQ(0, mDevice->add_logical_address(mDevice, CEC_ADDR_PLAYBACK_1));
+        ASSERT_TRUE(waitClaimed(CEC_LOG_ADDR_PLAYBACK_1)) << "HAL did not claim playback 1";
+    }
+
+    void TearDown() override {
+        if (mDevice != nullptr) mDevice->common.close(&mDevice->common);
+        if (mTvFd >= 0) {
+            struct cec_log_addrs laddrs = {};
+            ioctl(mTvFd, CEC_ADAP_S_LOG_ADDRS, &laddrs);
+        }
+    }
+
+    static void onEvent(const hdmi_event_t* event, void* arg) {
+        auto* self = static_cast<HdmiCecReplayTest*>(arg);
+        std::lock_guard<std::mutex> lock(self->mLock);
+
+        if (event->type == HDMI_EVENT_HOT_PLUG) {
+            self->mHotplugs++;
+        } else if (event->type == HDMI_EVENT_CEC_MESSAGE &&
+                   event->cec.initiator == CEC_ADDR_TV) {
+            self->mReceivedNs.push_back(nowNs());
+        }
+        self->mCv.notify_all();
+    }
+
+    bool waitClaimed(unsigned addr) {
+        auto deadline = std::chrono::steady_clock::now() + kClaimTimeout;
+
+        while (std::chrono::steady_clock::now() < deadline) {
+            struct cec_log_addrs laddrs = {};
+            if (ioctl(mPlaybackFd, CEC_ADAP_G_LOG_ADDRS, &laddrs) == 0 &&
+                (laddrs.log_addr_mask & (1 << addr)))
+                return true;
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+
+        return false;
+    }
+
+    /*
+     * Sends body from the TV to the HAL. Frames the bus acknowledged are
+     * counted in result->sent with their end of transmission time in txNs.
+     */
+    void inject(ScenarioResult* result, std::vector<uint64_t>* txNs,
+                const std::vector<uint8_t>& body, uint8_t dest = CEC_LOG_ADDR_PLAYBACK_1) {
+        struct cec_msg msg = {};
+
+        msg.msg[0] = (CEC_LOG_ADDR_TV << 4) | dest;
+        msg.len = 1 + std::min(body.size(), sizeof(msg.msg) - 1);
+        std::copy_n(body.begin(), msg.len - 1, &msg.msg[1]);
+
+        if (ioctl(mTvFd, CEC_TRANSMIT, &msg) || !(msg.tx_status & CEC_TX_STATUS_OK)) return;
+        result->sent++;
+        txNs->push_back(msg.tx_ts);
+    }
+
+    // Waits for the callbacks of the frames in txNs, received from index first on
+    void collect(ScenarioResult* result, size_t first, const std::vector<uint64_t>& txNs) {
+        std::unique_lock<std::mutex> lock(mLock);
+        mCv.wait_for(lock, kDeliveryTimeout,
+                     [&] { return mReceivedNs.size() - first >= txNs.size(); });
+
+        result->delivered = std::min(mReceivedNs.size() - first, txNs.size());
+        for (size_t i = 0; i < result->delivered; i++)
+            result->latencyUs.push_back((mReceivedNs[first + i] - txNs[i]) / 1000);
+    }
+
+    size_t receivedCount() {
+        std::lock_guard<std::mutex> lock(mLock);
+        return mReceivedNs.size();
+    }
+
+    // rx_dropped + rx_lost from the HAL's dump
+    unsigned halDrops() {
+        FILE* file = tmpfile();
+        std::string dump;
+        unsigned dropped = 0, lost = 0;
+
+        if (file == nullptr) return 0;
+        HAL_MODULE_INFO_SYM.dump(mDevice, fileno(file));
+        lseek(fileno(file), 0, SEEK_SET);
+        ReadFdToString(fileno(file), &dump);
+        fclose(file);
+
+        size_t pos = dump.find("rx_dropped=");
+        if (pos != std::string::npos)
+            sscanf(dump.c_str() + pos, "rx_dropped=%u rx_lost=%u", &dropped, &lost);
+        return dropped + lost;
+    }
+
+    void report(const char* name, const ScenarioResult& result) {
+        double seconds = result.elapsedNs / 1e9;
+        uint64_t p50 = percentileUs(result.latencyUs, 50);
+        uint64_t p99 = percentileUs(result.latencyUs, 99);
+
+        printf("%s: sent=%u delivered=%u dropped=%u %.1f frames/s p50=%lluus p99=%lluus\n",
+               name, result.sent, result.delivered, result.sent - result.delivered,
+               seconds > 0 ? result.delivered / seconds : 0.0, (unsigned long long)p50,
+               (unsigned long long)p99);
+        RecordProperty("sent", result.sent);
+        RecordProperty("delivered", result.delivered);
+        RecordProperty("p50_us", std::to_string(p50));
+        RecordProperty("p99_us", std::to_string(p99));
+    }
+
+    unique_fd mPlaybackFd;
+    unique_fd mTvFd;
+    hdmi_cec_device_t* mDevice = nullptr;
+
+    std::mutex mLock;
+    std::condition_variable mCv;
+    std::vector<uint64_t> mReceivedNs;
+    unsigned mHotplugs = 0;
+};
+
+// A held remote key: back to back <User Control Pressed>/<Released> pairs
+TEST_F(HdmiCecReplayTest, RemoteKeyBurst) {
+    constexpr int kPresses = 40;
+    ScenarioResult result;
+    std::vector<uint64_t> txNs;
+    size_t first = receivedCount();
+    uint64_t start = nowNs();
+
+    for (int i = 0; i < kPresses; i++) {
+        inject(&result, &txNs, {CEC_MSG_USER_CONTROL_PRESSED, CEC_OP_UI_CMD_UP});
+        inject(&result, &txNs, {CEC_MSG_USER_CONTROL_RELEASED});
+    }
+    collect(&result, first, txNs);
+    result.elapsedNs = nowNs() - start;
+    report("remote key burst", result);
+
+    EXPECT_EQ(2u * kPresses, result.sent) << "the bus refused frames";
+    EXPECT_EQ(result.sent, result.delivered);
+    EXPECT_EQ(0u, halDrops());
+    EXPECT_LE(percentileUs(result.latencyUs, 99), kMaxP99LatencyUs);
+}
+
+// A TV polling the power status of a player in standby, answered by the HAL itself
+TEST_F(HdmiCecReplayTest, StandbyPolling) {
+    constexpr int kPolls = 20;
+    ScenarioResult result;
+    uint64_t start = nowNs();
+
+    mDevice->set_option(mDevice, HDMI_OPTION_SYSTEM_CEC_CONTROL, 0);
+
+    for (int i = 0; i < kPolls; i++) {
+        struct cec_msg msg = {};
+
+        msg.msg[0] = (CEC_LOG_ADDR_TV << 4) | CEC_LOG_ADDR_PLAYBACK_1;
+        msg.msg[1] = CEC_MSG_GIVE_DEVICE_POWER_STATUS;
+        msg.len = 2;
+        msg.reply = CEC_MSG_REPORT_POWER_STATUS;
+        msg.timeout = 1000;
+
+        if (ioctl(mTvFd, CEC_TRANSMIT, &msg) || !(msg.tx_status & CEC_TX_STATUS_OK)) continue;
+        result.sent++;
+
+        if (!(msg.rx_status & CEC_RX_STATUS_OK)) continue;
+        EXPECT_EQ(CEC_OP_POWER_STATUS_STANDBY, msg.msg[2]);
+        result.delivered++;
+        result.latencyUs.push_back((msg.rx_ts - msg.tx_ts) / 1000);
+    }
+    result.elapsedNs = nowNs() - start;
+    report("standby polling", result);
+
+    EXPECT_EQ(static_cast<unsigned>(kPolls), result.sent);
+    EXPECT_EQ(result.sent, result.delivered) << "polls left unanswered";
+}
+
+// The HAL's adapter losing and regaining its physical address in quick succession
+TEST_F(HdmiCecReplayTest, HotplugStorm) {
+    constexpr int kToggles = 20;
+    struct cec_caps caps = {};
+    uint16_t physAddr;
+
+    ASSERT_EQ(0, ioctl(mPlaybackFd, CEC_ADAP_G_CAPS, &caps));
+    if (!(caps.capabilities & CEC_CAP_PHYS_ADDR))
+        GTEST_SKIP() << caps.name << " has no CEC_CAP_PHYS_ADDR";
+    ASSERT_EQ(0, ioctl(mPlaybackFd, CEC_ADAP_G_PHYS_ADDR, &physAddr));
+
+    unsigned before;
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        before = mHotplugs;
+    }
+
+    for (int i = 0; i < kToggles; i++) {
+        uint16_t invalid = CEC_PHYS_ADDR_INVALID;
+        ASSERT_EQ(0, ioctl(mPlaybackFd, CEC_ADAP_S_PHYS_ADDR, &invalid));
+        ASSERT_EQ(0, ioctl(mPlaybackFd, CEC_ADAP_S_PHYS_ADDR, &physAddr));
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(mLock);
+        mCv.wait_for(lock, kDeliveryTimeout, [&] { return mHotplugs - before >= 2; });
+        printf("hotplug storm: toggles=%d callbacks=%u\n", kToggles, mHotplugs - before);
+        EXPECT_GE(mHotplugs - before, 2u);
+    }
+
+    EXPECT_TRUE(waitClaimed(CEC_LOG_ADDR_PLAYBACK_1)) << "address lost after the storm";
+    EXPECT_EQ(HDMI_CONNECTED, mDevice->is_connected(mDevice, 1));
+    EXPECT_EQ(0u, halDrops());
+}
+
+/*
+ * Replays the bus trace from the HAL's dump: received frames are sent by
+ * the TV, transmits go through send_message and state changes are skipped.
+ * Frames keep their opcode and operands, the addresses are rewritten to
+ * the TV and the HAL's playback address.
+ */
+TEST_F(HdmiCecReplayTest, ReplayTrace) {
+    const char* path = getenv("CEC_REPLAY_TRACE");
+    if (path == nullptr) GTEST_SKIP() << "set CEC_REPLAY_TRACE to a dumped bus trace";
+
+    const char* speedEnv = getenv("CEC_REPLAY_SPEED");
+    double speed = speedEnv != nullptr ? atof(speedEnv) : 1.0;
+
+    std::string trace;
+    ASSERT_TRUE(ReadFileToString(path, &trace)) << path;
+
+    ScenarioResult result;
+    std::vector<uint64_t> txNs;
+    unsigned halTx = 0, halTxOk = 0, skipped = 0;
+    uint64_t lastTs = 0;
+    size_t first = receivedCount();
+    uint64_t start = nowNs();
+
+    for (const std::string& line : Split(trace, "\n")) {
+        unsigned long long ts;
+        unsigned port, status;
+        char dir[8], bytes[64];
+
+        // "<ts> <port> <rx|tx|state> <status> <aa:bb:..>"
+        if (sscanf(line.c_str(), " %llu %u %7s %x %63s", &ts, &port, dir, &status, bytes) != 5)
+            continue;
+
+        std::vector<uint8_t> frame;
+        for (const std::string& byte : Split(bytes, ":"))
+            frame.push_back(strtoul(byte.c_str(), nullptr, 16));
+        if (frame.size() < 2 || !strcmp(dir, "state")) {
+            skipped++;
+            continue;
+        }
+
+        if (speed > 0 && lastTs != 0 && ts > lastTs)
+            std::this_thread::sleep_for(std::chrono::nanoseconds(
+                    static_cast<uint64_t>((ts - lastTs) / speed)));
+        lastTs = ts;
+
+        bool broadcast = (frame[0] & 0xf) == CEC_LOG_ADDR_BROADCAST;
+        std::vector<uint8_t> body(frame.begin() + 1, frame.end());
+
+        if (!strcmp(dir, "rx")) {
+            inject(&result, &txNs, body,
+                   broadcast ? CEC_LOG_ADDR_BROADCAST : CEC_LOG_ADDR_PLAYBACK_1);
+        } else {
+            cec_message_t msg = {};
+
+            msg.initiator = CEC_ADDR_PLAYBACK_1;
+            msg.destination = broadcast ? CEC_ADDR_BROADCAST : CEC_ADDR_TV;
+            msg.length = std::min(body.size(), sizeof(msg.body));
+            std::copy_n(body.begin(), msg.length, msg.body);
+            halTx++;
+            if (mDevice->send_message(mDevice, &msg) == HDMI_RESULT_SUCCESS) halTxOk++;
+        }
+    }
+    collect(&result, first, txNs);
+    result.elapsedNs = nowNs() - start;
+    report("replay", result);
+    printf("replay: hal_tx=%u hal_tx_ok=%u skipped=%u\n", halTx, halTxOk, skipped);
+
+    EXPECT_EQ(result.sent, result.delivered);
+    EXPECT_EQ(halTx, halTxOk);
+    EXPECT_EQ(0u, halDrops());
+}
+
+}  // namespace
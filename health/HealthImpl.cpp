@@ -17,20 +17,154 @@
 
 #include "HealthImpl.h"
 
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/parseint.h>
+#include <android-base/strings.h>
+#include <cutils/uevent.h>
+#include <dirent.h>
+#include <health/HealthLoop.h>
+#include <string.h>
+
 using ::aidl::android::hardware::health::BatteryHealth;
 using ::aidl::android::hardware::health::BatteryStatus;
 using ::aidl::android::hardware::health::HealthInfo;
+using ::android::base::ParseUint;
+using ::android::base::ReadFileToString;
+using ::android::base::Trim;
+using ::android::hardware::health::EVENT_NO_WAKEUP_FD;
+using ::android::hardware::health::HealthLoop;
 
 namespace aidl::android::hardware::health {
 
+static const std::string hwmonClass = "/sys/class/hwmon/";
+static const char throttledPath[] = "/sys/devices/platform/soc/soc:firmware/get_throttled";
+
+// get_throttled bits, the same ones vcgencmd reports
+static constexpr uint32_t kUnderVoltage = 1 << 0;
+static constexpr uint32_t kFreqCapped = 1 << 1;
+static constexpr uint32_t kThrottled = 1 << 2;
+static constexpr uint32_t kSoftTempLimit = 1 << 3;
+
+static constexpr int kUeventMsgLen = 2048;
+
+static bool readUint(const std::string& path, uint32_t* value) {
+    std::string content;
+
+    return ReadFileToString(path, &content) && ParseUint(Trim(content), value);
+}
+
+static std::string findUnderVoltageAlarm() {
+    std::unique_ptr<DIR, decltype(&closedir)> dir(opendir(hwmonClass.c_str()), closedir);
+    struct dirent* entry;
+
+    while (dir && (entry = readdir(dir.get())) != nullptr) {
+        std::string name;
+        std::string path = hwmonClass + entry->d_name;
+
+        if (ReadFileToString(path + "/name", &name) && Trim(name) == "rpi_volt") {
+            return path + "/in0_lcrit_alarm";
+        }
+    }
+    return "";
+}
+
+/*
+ * power_supply uevents already reach HalHealthLoop. rpi_volt raises its
+ * under-voltage alarm as a hwmon change uevent, which the loop ignores, so
+ * listen for those on the same epoll loop and update when they arrive.
+ */
+void HealthImpl::OnInit(HalHealthLoop* hal_health_loop, struct healthd_config* config) {
+    Health::OnInit(hal_health_loop, config);
+
+    under_voltage_path_ = findUnderVoltageAlarm();
+    if (under_voltage_path_.empty()) {
+        LOG(WARNING) << "rpi_volt hwmon not found, under-voltage is not monitored";
+        return;
+    }
+
+    uevent_fd_.reset(uevent_open_socket(64 * 1024, true));
+    if (uevent_fd_.get() < 0) {
+        LOG(ERROR) << "Failed to open uevent socket for hwmon";
+        return;
+    }
+
+    std::shared_ptr<HealthImpl> thiz = ref<HealthImpl>();
+    auto uevent_event = [thiz](HealthLoop*, uint32_t epevents) { thiz->UeventEvent(epevents); };
+    if (hal_health_loop->RegisterEvent(uevent_fd_.get(), uevent_event, EVENT_NO_WAKEUP_FD) != 0) {
+        LOG(ERROR) << "Failed to register hwmon uevent handler";
+    }
+}
+
+void HealthImpl::UeventEvent(uint32_t /* epevents */) {
+    char msg[kUeventMsgLen + 2];
+    bool hwmon = false;
+    int n;
+
+    n = uevent_kernel_multicast_recv(uevent_fd_.get(), msg, kUeventMsgLen);
+    if (n <= 0 || n >= kUeventMsgLen) return;
+    msg[n] = '\0';
+    msg[n + 1] = '\0';
+
+    for (char* cp = msg; *cp; cp += strlen(cp) + 1) {
+        if (!strcmp(cp, "SUBSYSTEM=hwmon")) hwmon = true;
+    }
+
+    if (hwmon) update();
+}
+
 void HealthImpl::UpdateHealthInfo(HealthInfo* health_info) {
-    health_info->chargerAcOnline = true;
-    health_info->batteryLevel = 100;
-    health_info->batteryStatus = BatteryStatus::CHARGING;
-    health_info->batteryHealth = BatteryHealth::GOOD;
+    std::string throttled_hex;
+    uint32_t value;
+    bool under_voltage = false;
+    uint32_t throttled = 0;
+
+    // A UPS HAT or other fuel gauge reports through power_supply, keep what it says
+    battery_present_ = health_info->batteryPresent;
+    if (!battery_present_) {
+        health_info->chargerAcOnline = true;
+        health_info->batteryLevel = 100;
+        health_info->batteryStatus = BatteryStatus::CHARGING;
+        health_info->batteryHealth = BatteryHealth::GOOD;
+    }
+
+    if (!under_voltage_path_.empty() && readUint(under_voltage_path_, &value)) {
+        under_voltage = value != 0;
+    }
+    // get_throttled is printed in hex without a prefix
+    if (ReadFileToString(throttledPath, &throttled_hex) &&
+        ParseUint("0x" + Trim(throttled_hex), &value)) {
+        throttled = value & (kUnderVoltage | kFreqCapped | kThrottled | kSoftTempLimit);
+        under_voltage |= (throttled & kUnderVoltage) != 0;
+    }
+
+    if (under_voltage != under_voltage_) {
+        if (under_voltage) {
+            LOG(WARNING) << "Under-voltage detected, the supply cannot keep up";
+        } else {
+            LOG(INFO) << "Supply voltage back to normal";
+        }
+        under_voltage_ = under_voltage;
+    }
+    if (throttled != throttled_) {
+        LOG(WARNING) << "Firmware throttling state 0x" << std::hex << throttled
+                     << ((throttled & kFreqCapped) ? ", ARM frequency capped" : "")
+                     << ((throttled & kThrottled) ? ", throttled" : "")
+                     << ((throttled & kSoftTempLimit) ? ", soft temperature limit" : "");
+        throttled_ = throttled;
+    }
+
+    // A starved supply is a supply failure, whatever the gauge thinks
+    if (under_voltage_) {
+        health_info->batteryHealth = BatteryHealth::UNSPECIFIED_FAILURE;
+    }
 }
 
 ndk::ScopedAStatus HealthImpl::getChargeStatus(BatteryStatus* out) {
+    if (battery_present_) {
+        return Health::getChargeStatus(out);
+    }
+
     *out = BatteryStatus::CHARGING;
     return ndk::ScopedAStatus::ok();
 }
@@ -17,8 +17,11 @@
 
 #pragma once
 
+#include <android-base/unique_fd.h>
 #include <health-impl/Health.h>
 
+#include <atomic>
+
 using ::aidl::android::hardware::health::Health;
 
 namespace aidl::android::hardware::health {
@@ -29,9 +32,20 @@ public:
     virtual ~HealthImpl() {}
 
     ndk::ScopedAStatus getChargeStatus(BatteryStatus* out) override;
+    void OnInit(HalHealthLoop* hal_health_loop, struct healthd_config* config) override;
 
 protected:
     void UpdateHealthInfo(HealthInfo* health_info) override;
+
+private:
+    void UeventEvent(uint32_t epevents);
+
+    // rpi_volt hwmon alarm and firmware throttling state, see UpdateHealthInfo
+    std::string under_voltage_path_;
+    ::android::base::unique_fd uevent_fd_;
+    bool under_voltage_ = false;
+    uint32_t throttled_ = 0;
+    std::atomic<bool> battery_present_ = false;  // read by getChargeStatus on binder threads
 };
 
 }  // namespace aidl::android::hardware::health
@@ -26,6 +26,8 @@ using ::aidl::android::hardware::health::HealthImpl;
 int main() {
     auto config = std::make_unique<healthd_config>();
     android::hardware::health::InitHealthdConfig(config.get());
+    // Supplies and the under-voltage alarm report through uevents, do not poll on mains
+    config->periodic_chores_interval_fast = -1;
     auto binder = ndk::SharedRefBase::make<HealthImpl>("default", std::move(config));
     auto hal_health_loop = std::make_shared<HalHealthLoop>(binder, binder);
     return hal_health_loop->StartLoop();
@@ -18,30 +18,403 @@
 #include "Lights.h"
 
 #include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/properties.h>
+#include <android-base/strings.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <linux/netlink.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
 
+#include <algorithm>
+#include <cmath>
+
+using ::android::base::GetProperty;
+using ::android::base::ParseUint;
+using ::android::base::ReadFileToString;
+using ::android::base::Split;
+using ::android::base::Trim;
+using ::android::base::unique_fd;
 using ::android::base::WriteStringToFile;
 
 namespace aidl::android::hardware::light {
 
-static const std::string backlightFiles[] = {
-    "/sys/class/backlight/rpi_backlight/brightness"
-};
+// Brightness animations go no faster than the display refreshes.
+static constexpr std::chrono::nanoseconds kBacklightInterval = std::chrono::milliseconds(16);
+
+// Ramps move evenly in perceived lightness, which roughly follows gamma 2.2.
+static constexpr double kGamma = 2.2;
+
+static const std::string backlightClass = "/sys/class/backlight/";
+static const std::string ledsClass = "/sys/class/leds/";
+
+static uint32_t readMaxBrightness(const std::string& path) {
+    std::string value;
+    uint32_t max;
+
+    if (!ReadFileToString(path + "/max_brightness", &value) ||
+        !ParseUint(Trim(value), &max) || max == 0) {
+        return 255;
+    }
+    return max;
+}
 
-const static std::vector<HwLight> availableLights = {
-    {.id = (int)LightType::BACKLIGHT, .type = LightType::BACKLIGHT, .ordinal = 0}
-};
+// Scales 0-255 to the device range, anything lit stays lit.
+static uint32_t scaleBrightness(double brightness, uint32_t max) {
+    uint32_t scaled = std::lround(brightness * max / 255);
+    return (brightness > 0 && !scaled) ? 1 : scaled;
+}
+
+static double perceptualLevel(uint32_t from, uint32_t to, double progress) {
+    double start = std::pow(from / 255.0, 1 / kGamma);
+    double end = std::pow(to / 255.0, 1 / kGamma);
+    return 255 * std::pow(start + (end - start) * progress, kGamma);
+}
+
+// The trigger file lists every trigger and brackets the active one.
+static std::string activeTrigger(const std::string& path) {
+    std::string triggers;
+
+    if (ReadFileToString(path + "/trigger", &triggers)) {
+        for (auto& trigger : Split(Trim(triggers), " ")) {
+            if (trigger.size() > 2 && trigger.front() == '[' && trigger.back() == ']') {
+                return trigger.substr(1, trigger.size() - 2);
+            }
+        }
+    }
+    return "none";
+}
+
+Lights::Lights() {
+    mLights.push_back({.id = 0, .type = LightType::BACKLIGHT, .ordinal = 0});
+    mLeds.emplace_back();
+    scanBacklights();
+
+    addLed(LightType::NOTIFICATIONS, GetProperty("ro.vendor.light.notification", "ACT"));
+    addLed(LightType::ATTENTION, GetProperty("ro.vendor.light.attention", "PWR"));
+    mPendingLeds.resize(mLeds.size());
+    mLedThread = std::thread(&Lights::applyLeds, this);
+
+    mRampDuration = std::chrono::milliseconds(
+            ::android::base::GetUintProperty<uint32_t>("ro.vendor.light.ramp_ms", 0));
+    mWakeFd.reset(eventfd(0, EFD_CLOEXEC));
+    mTimerFd.reset(timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC));
+    CHECK(mWakeFd.get() >= 0 && mTimerFd.get() >= 0) << "Failed to create ramp fds";
+    mRampThread = std::thread(&Lights::rampBacklight, this);
+
+    // Panels probe late or get reloaded, follow their backlights
+    struct sockaddr_nl addr = {};
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = 1;
+    mUeventFd.reset(socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT));
+    mExitFd.reset(eventfd(0, EFD_CLOEXEC));
+    if (mUeventFd.get() < 0 || mExitFd.get() < 0 ||
+        bind(mUeventFd.get(), (struct sockaddr*)&addr, sizeof(addr))) {
+        PLOG(ERROR) << "Backlights will not be rescanned";
+        return;
+    }
+    mUeventThread = std::thread(&Lights::watchUevents, this);
+}
+
+Lights::~Lights() {
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        mExit = true;
+    }
+    wakeRamp();
+    mRampThread.join();
+
+    {
+        std::lock_guard<std::mutex> lock(mLedLock);
+        mLedExit = true;
+    }
+    mLedCv.notify_one();
+    mLedThread.join();
+
+    if (mUeventThread.joinable()) {
+        uint64_t flag = 1;
+        write(mExitFd.get(), &flag, sizeof(flag));
+        mUeventThread.join();
+    }
+}
+
+void Lights::scanBacklights() {
+    std::unique_ptr<DIR, decltype(&closedir)> dir(opendir(backlightClass.c_str()), closedir);
+    std::vector<Backlight> backlights;
+    struct dirent* entry;
+
+    while (dir && (entry = readdir(dir.get())) != nullptr) {
+        if (entry->d_name[0] == '.') continue;
+
+        std::string path = backlightClass + entry->d_name;
+        unique_fd fd(open((path + "/brightness").c_str(), O_WRONLY | O_CLOEXEC));
+        if (fd.get() < 0) {
+            PLOG(ERROR) << "Failed to open " << path << "/brightness";
+            continue;
+        }
+        backlights.push_back({entry->d_name, std::move(fd), readMaxBrightness(path), std::nullopt});
+        LOG(INFO) << "Backlight " << entry->d_name << ", max " << backlights.back().maxBrightness;
+    }
+
+    std::lock_guard<std::mutex> lock(mBacklightLock);
+    mBacklights = std::move(backlights);
+}
+
+void Lights::addLed(LightType type, const std::string& name) {
+    std::string path = ledsClass + name;
+
+    if (name.empty() || access((path + "/brightness").c_str(), W_OK)) return;
+
+    mLights.push_back({.id = (int)mLights.size(), .type = type, .ordinal = 0});
+    std::string trigger = activeTrigger(path);
+    mLeds.push_back(Led{path, readMaxBrightness(path), trigger, trigger});
+    LOG(INFO) << "LED " << name << " for light type " << (int)type;
+}
+
+/*
+ * The trigger's attributes appear with it, ueventd hands them over shortly
+ * after. Only switching triggers waits for that, staying on the same one
+ * keeps its attributes.
+ */
+static bool setTrigger(Led& led, const std::string& trigger, const std::string& attribute) {
+    std::string const path = led.path + "/" + attribute;
+
+    if (led.trigger == trigger) return true;
+    led.trigger.clear();  // unknown until the attributes are usable
+    if (!WriteStringToFile(trigger, led.path + "/trigger")) return false;
+
+    for (int i = 0; i < 20 && access(path.c_str(), W_OK); i++) {
+        usleep(5000);
+    }
+    if (access(path.c_str(), W_OK)) {
+        PLOG(ERROR) << "LED trigger " << trigger << " left " << path << " unwritable";
+        return false;
+    }
+    led.trigger = trigger;
+    return true;
+}
+
+/*
+ * Blinking and fading run on the kernel timer and pattern triggers, user
+ * space does not wake up for them. Flash mode HARDWARE breathes: half of
+ * each phase fades, the other half holds.
+ */
+void Lights::setLed(Led& led, const HwLightState& state) {
+    uint32_t brightness = scaleBrightness(rgbToBrightness(state), led.maxBrightness);
+    bool blink = state.flashMode != FlashMode::NONE && state.flashOnMs > 0 &&
+            state.flashOffMs > 0;
+    std::string const level = std::to_string(brightness);
+
+    if (!brightness) {
+        // Give the LED back to what the kernel used it for
+        WriteStringToFile("0", led.path + "/brightness");
+        WriteStringToFile(led.defaultTrigger, led.path + "/trigger");
+        led.trigger = led.defaultTrigger;
+        return;
+    }
+
+    if (!blink) {
+        WriteStringToFile("none", led.path + "/trigger");
+        led.trigger = "none";
+        WriteStringToFile(level, led.path + "/brightness");
+        return;
+    }
+
+    if (state.flashMode == FlashMode::HARDWARE && setTrigger(led, "pattern", "pattern")) {
+        std::string const on = std::to_string(state.flashOnMs / 2);
+        std::string const off = std::to_string(state.flashOffMs / 2);
+        if (WriteStringToFile("0 " + on + " " + level + " " + on + " " + level + " " + off +
+                              " 0 " + off, led.path + "/pattern") &&
+            WriteStringToFile("-1", led.path + "/repeat")) {
+            return;
+        }
+        PLOG(ERROR) << "Failed to set " << led.path << " pattern, falling back to timer";
+    }
+
+    // Kernels without ledtrig-pattern still blink
+    if (!setTrigger(led, "timer", "delay_on")) return;
+    WriteStringToFile(std::to_string(state.flashOnMs), led.path + "/delay_on");
+    WriteStringToFile(std::to_string(state.flashOffMs), led.path + "/delay_off");
+    WriteStringToFile(level, led.path + "/brightness");
+}
+
+void Lights::applyLeds() {
+    std::unique_lock<std::mutex> lock(mLedLock);
+
+    while (true) {
+        mLedCv.wait(lock, [this] {
+            return mLedExit || std::any_of(mPendingLeds.begin(), mPendingLeds.end(),
+                                           [](const auto& state) { return state.has_value(); });
+        });
+        if (mLedExit) return;
+
+        for (size_t id = 0; id < mPendingLeds.size(); id++) {
+            if (!mPendingLeds[id].has_value()) continue;
+
+            HwLightState state = *mPendingLeds[id];
+            mPendingLeds[id].reset();
+            lock.unlock();
+            setLed(*mLeds[id], state);
+            lock.lock();
+        }
+    }
+}
+
+void Lights::wakeRamp() {
+    uint64_t flag = 1;
+    write(mWakeFd.get(), &flag, sizeof(flag));
+}
+
+void Lights::writeBacklightLevel(double level) {
+    std::lock_guard<std::mutex> lock(mBacklightLock);
+
+    // Only steps that change a backlight's own range reach sysfs
+    for (auto &backlight : mBacklights) {
+        uint32_t scaled = scaleBrightness(level, backlight.maxBrightness);
+        if (backlight.written == scaled) continue;
+
+        std::string const value = std::to_string(scaled);
+        if (pwrite(backlight.fd.get(), value.c_str(), value.size(), 0) < 0) {
+            PLOG(ERROR) << "Failed to write " << backlight.name << " brightness " << value;
+            continue;
+        }
+        backlight.written = scaled;
+    }
+}
+
+/*
+ * Moves the backlight to the latest brightness on kBacklightInterval ticks
+ * of mTimerFd, so values set in between are superseded and never reach
+ * sysfs. With ro.vendor.light.ramp_ms set, a new target is approached over
+ * that time along a perceptual curve, starting from wherever the previous
+ * ramp got to. The timer is disarmed while the backlight is settled.
+ */
+void Lights::rampBacklight() {
+    using std::chrono::steady_clock;
+    struct pollfd fds[] = {{mWakeFd.get(), POLLIN, 0}, {mTimerFd.get(), POLLIN, 0}};
+    struct itimerspec tick = {};
+    std::optional<double> level;
+    uint32_t from = 0;
+    uint32_t to = 0;
+    steady_clock::time_point start;
+    std::chrono::nanoseconds duration(0);
+    bool ramping = false;
+    uint64_t count;
+
+    tick.it_interval.tv_nsec = kBacklightInterval.count();
+    tick.it_value.tv_nsec = kBacklightInterval.count();
+
+    while (true) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            PLOG(ERROR) << "Backlight ramp poll failed";
+            return;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            read(mWakeFd.get(), &count, sizeof(count));
+
+            std::lock_guard<std::mutex> lock(mLock);
+            if (mExit) return;
+            if (mPendingBrightness.has_value()) {
+                // Ramp from the level reached so far, a first value is applied as is
+                from = level.has_value() ? std::lround(*level) : *mPendingBrightness;
+                to = *mPendingBrightness;
+                mPendingBrightness.reset();
+                start = steady_clock::now();
+                duration = level.has_value() ? mRampDuration : std::chrono::nanoseconds(0);
+
+                // Keep ticking while ramping, the next tick bounds the rate
+                if (!ramping) timerfd_settime(mTimerFd.get(), 0, &tick, nullptr);
+                ramping = true;
+            }
+        }
+
+        if (!(fds[1].revents & POLLIN)) continue;
+        read(mTimerFd.get(), &count, sizeof(count));
+        if (!ramping) continue;
+
+        auto elapsed = steady_clock::now() - start;
+        double next = to;
+        if (elapsed < duration) {
+            next = perceptualLevel(from, to, (double)elapsed.count() / duration.count());
+        }
+
+        writeBacklightLevel(next);
+        level = next;
+
+        if (elapsed >= duration) {
+            struct itimerspec stop = {};
+            timerfd_settime(mTimerFd.get(), 0, &stop, nullptr);
+            ramping = false;
+        }
+    }
+}
+
+void Lights::watchUevents() {
+    struct pollfd fds[] = {{mUeventFd.get(), POLLIN, 0}, {mExitFd.get(), POLLIN, 0}};
+    char buf[2048];
+
+    while (true) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            PLOG(ERROR) << "uevent poll failed";
+            return;
+        }
+        if (fds[1].revents) return;
+
+        ssize_t len = recv(mUeventFd.get(), buf, sizeof(buf) - 1, 0);
+        if (len <= 0) continue;
+        buf[len] = '\0';
+
+        // Messages are NUL separated KEY=value pairs after an action@path header
+        bool backlight = false;
+        bool hotplug = false;
+        for (char* field = buf; field < buf + len; field += strlen(field) + 1) {
+            if (!strcmp(field, "SUBSYSTEM=backlight")) backlight = true;
+            if (!strcmp(field, "ACTION=add") || !strcmp(field, "ACTION=remove")) hotplug = true;
+        }
+        if (!backlight || !hotplug) continue;
+
+        scanBacklights();
+
+        // A new panel starts from its own default, give it the current level
+        std::lock_guard<std::mutex> lock(mLock);
+        if (mBrightness.has_value()) {
+            mPendingBrightness = mBrightness;
+            wakeRamp();
+        }
+    }
+}
 
 ndk::ScopedAStatus Lights::setLightState(int id, const HwLightState& state) {
-    HwLight const& light = availableLights[id];
-    std::string const brightness = std::to_string(rgbToBrightness(state));
+    if (id < 0 || id >= (int)mLights.size()) {
+        return ndk::ScopedAStatus::fromExceptionCode(EX_UNSUPPORTED_OPERATION);
+    }
+
+    HwLight const& light = mLights[id];
 
     switch (light.type) {
         case LightType::BACKLIGHT:
-            for (auto &file : backlightFiles) {
-                if (!access(file.c_str(), W_OK)) {
-                    WriteStringToFile(brightness, file);
-                }
+            {
+                std::lock_guard<std::mutex> lock(mLock);
+                mBrightness = rgbToBrightness(state);
+                mPendingBrightness = mBrightness;
+            }
+            wakeRamp();
+            break;
+        case LightType::NOTIFICATIONS:
+        case LightType::ATTENTION:
+            {
+                std::lock_guard<std::mutex> lock(mLedLock);
+                mPendingLeds[id] = state;
             }
+            mLedCv.notify_one();
             break;
         default:
             return ndk::ScopedAStatus::fromExceptionCode(EX_UNSUPPORTED_OPERATION);
@@ -51,7 +424,7 @@ ndk::ScopedAStatus Lights::setLightState(int id, const HwLightState& state) {
 }
 
 ndk::ScopedAStatus Lights::getLights(std::vector<HwLight>* lights) {
-    for (auto i = availableLights.begin(); i != availableLights.end(); i++) {
+    for (auto i = mLights.begin(); i != mLights.end(); i++) {
         lights->push_back(*i);
     }
 
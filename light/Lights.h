@@ -18,16 +18,80 @@
 #pragma once
 
 #include <aidl/android/hardware/light/BnLights.h>
+#include <android-base/unique_fd.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <optional>
+#include <thread>
 
 namespace aidl::android::hardware::light {
 
+// A /sys/class/backlight device, brightness opened once and written with pwrite().
+struct Backlight {
+    std::string name;
+    ::android::base::unique_fd fd;
+    uint32_t maxBrightness;
+    std::optional<uint32_t> written;  // unset until the HAL first writes it
+};
+
+// A /sys/class/leds device and the trigger it had before the HAL took it.
+struct Led {
+    std::string path;
+    uint32_t maxBrightness;
+    std::string defaultTrigger;
+    std::string trigger;  // last set by the HAL, only touched on mLedThread
+};
+
 class Lights : public BnLights {
 public:
+    Lights();
+    ~Lights();
+
     ndk::ScopedAStatus setLightState(int id, const HwLightState& state) override;
     ndk::ScopedAStatus getLights(std::vector<HwLight>* types) override;
 
 private:
+    void scanBacklights();
+    void addLed(LightType type, const std::string& name);
+    void setLed(Led& led, const HwLightState& state);
+    void applyLeds();
+    void rampBacklight();
+    void writeBacklightLevel(double level);
+    void wakeRamp();
+    void watchUevents();
     uint32_t rgbToBrightness(const HwLightState& state);
+
+    std::vector<HwLight> mLights;
+    std::vector<std::optional<Led>> mLeds;  // indexed by light id
+
+    // LEDs are set on mLedThread, a new trigger's attributes take a moment
+    // to become writable. Only the latest state of each LED is kept.
+    std::mutex mLedLock;
+    std::condition_variable mLedCv;
+    std::vector<std::optional<HwLightState>> mPendingLeds;  // indexed by light id
+    bool mLedExit = false;
+    std::thread mLedThread;
+
+    // Backlights can come and go with their panel.
+    std::mutex mBacklightLock;
+    std::vector<Backlight> mBacklights;
+
+    // Only the latest brightness is kept, the ramp thread moves towards it
+    // on mTimerFd ticks and is woken through mWakeFd.
+    std::mutex mLock;
+    std::optional<uint32_t> mPendingBrightness;
+    std::optional<uint32_t> mBrightness;
+    bool mExit = false;
+    std::chrono::milliseconds mRampDuration;
+    ::android::base::unique_fd mWakeFd;
+    ::android::base::unique_fd mTimerFd;
+    std::thread mRampThread;
+
+    ::android::base::unique_fd mUeventFd;
+    ::android::base::unique_fd mExitFd;
+    std::thread mUeventThread;
 };
 
 }  // aidl::android::hardware::light
@@ -15,102 +15,628 @@
  * limitations under the License.
  */
 
-#define LOG_TAG "android.hardware.usb.gadget@1.2-service.rpi"
+#define LOG_TAG "android.hardware.usb.gadget-service.rpi"
 
 #include "UsbGadget.h"
+#include <ctype.h>
 #include <dirent.h>
 #include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/inotify.h>
+#include <sys/system_properties.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
+
+namespace aidl {
 namespace android {
 namespace hardware {
 namespace usb {
 namespace gadget {
-namespace V1_2 {
-namespace implementation {
 
-UsbGadget::UsbGadget() {
+static int64_t nowNs() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static const char* stateName(GadgetState state) {
+    switch (state) {
+        case GadgetState::IDLE:
+            return "idle";
+        case GadgetState::TEARDOWN:
+            return "teardown";
+        case GadgetState::CONFIGURE:
+            return "configure";
+        case GadgetState::WAIT_FFS:
+            return "wait-ffs";
+        case GadgetState::PULLED_UP:
+            return "pulled-up";
+        case GadgetState::ERROR:
+            return "error";
+    }
+    return "unknown";
+}
+
+UsbGadget::UsbGadget()
+    : mCurrentUsbFunctions(static_cast<uint64_t>(GadgetFunction::NONE)),
+      mCurrentUsbFunctionsApplied(false),
+      mUsbSpeed(UsbSpeed::UNKNOWN),
+      mHostAttached(true),
+      mLinkedFunctionsValid(false),
+      mMassStorageChanged(false),
+      mExit(false),
+      mState(GadgetState::IDLE),
+      mSpeedTransactionId(0),
+      mMassStorageExit(false) {
     if (access(OS_DESC_PATH, R_OK) != 0) {
         ALOGE("configfs setup not done yet");
         abort();
     }
+
+    loadCompositions();
+
+    mWorker = std::thread(&UsbGadget::worker, this);
+    mMassStorageThread = std::thread(&UsbGadget::massStorageMonitor, this);
+
+    // Without the monitor getUsbSpeed() falls back to reading sysfs
+    if (startUdcMonitor() != Status::SUCCESS) ALOGE("UDC state is not cached");
+}
+
+UsbGadget::~UsbGadget() {
+    mMassStorageExit = true;
+    mMassStorageThread.join();
+
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        mExit = true;
+    }
+    mCv.notify_one();
+    mWorker.join();
+
+    if (mUdcThread.joinable()) {
+        uint64_t flag = 1;
+        write(mUdcExitFd.get(), &flag, sizeof(flag));
+        mUdcThread.join();
+    }
+}
+
+// Called with mLock held.
+void UsbGadget::enterStateLocked(GadgetState state) {
+    int64_t now = nowNs();
+
+    if (!mTransitions.empty())
+        ALOGI("%s -> %s after %" PRId64 " us", stateName(mState), stateName(state),
+              (now - mTransitions.back().timestampNs) / 1000);
+
+    mState = state;
+    mTransitions.push_back({state, now});
+
+    if (state == GadgetState::PULLED_UP || state == GadgetState::IDLE ||
+        state == GadgetState::ERROR) {
+        if (mHistory.size() == kSwitchHistory) mHistory.pop_front();
+        mHistory.push_back({mCurrentUsbFunctions, mTransitions});
+    }
+}
+
+void UsbGadget::enterState(GadgetState state) {
+    std::lock_guard<std::mutex> lock(mLock);
+    enterStateLocked(state);
+}
+
+void UsbGadget::finishRequest(const GadgetRequest& request, Status status) {
+    ScopedAStatus ret;
+
+    if (!request.callback) return;
+
+    if (request.type == GadgetRequest::RESET)
+        ret = request.callback->resetCb(status, request.transactionId);
+    else
+        ret = request.callback->setCurrentUsbFunctionsCb(request.functions, status,
+                                                         request.transactionId);
+    if (!ret.isOk()) ALOGE("Error while replying to request: %s", ret.getDescription().c_str());
+}
+
+// The ffs daemons did not come up in time. The monitor keeps waiting for
+// them, only the caller is told. Drops mLock around the callback.
+void UsbGadget::expireWaitLocked(std::unique_lock<std::mutex>& lock) {
+    GadgetRequest request = std::move(*mWaiting);
+
+    mWaiting.reset();
+    ALOGI("Usb Gadget functions %" PRIx64 " not pulled up in %" PRId64 " ms", request.functions,
+          request.timeoutMs);
+
+    lock.unlock();
+    finishRequest(request, Status::ERROR);
+    lock.lock();
+}
+
+void UsbGadget::worker() {
+    std::unique_lock<std::mutex> lock(mLock);
+
+    while (!mExit) {
+        if (!mPending.has_value() && !mMassStorageChanged) {
+            if (!mWaiting.has_value()) {
+                mCv.wait(lock);
+            } else if (mCv.wait_until(lock, mWaitDeadline) == std::cv_status::timeout &&
+                       mWaiting.has_value()) {
+                expireWaitLocked(lock);
+            }
+            continue;
+        }
+
+        if (mMassStorageChanged) {
+            mMassStorageChanged = false;
+            lock.unlock();
+            reloadMassStorage();
+            lock.lock();
+            continue;
+        }
+
+        GadgetRequest request = std::move(*mPending);
+        mPending.reset();
+        lock.unlock();
+
+        switch (request.type) {
+            case GadgetRequest::SET_FUNCTIONS:
+                applyFunctions(request);
+                break;
+            case GadgetRequest::RESET:
+                finishRequest(request, pullDownAndUp());
+                break;
+        }
+
+        lock.lock();
+    }
+}
+
+void UsbGadget::queueRequest(GadgetRequest request) {
+    std::optional<GadgetRequest> superseded;
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+
+        // A pending function switch re-enumerates anyway, a reset adds nothing
+        if (request.type == GadgetRequest::RESET && mPending.has_value()) {
+            superseded = std::move(request);
+        } else {
+            superseded = std::move(mPending);
+            mPending = std::move(request);
+        }
+    }
+    mCv.notify_one();
+
+    if (!superseded.has_value()) return;
+
+    if (superseded->type == GadgetRequest::SET_FUNCTIONS) {
+        ALOGI("Usb Gadget request for %" PRIx64 " superseded", superseded->functions);
+        finishRequest(*superseded, Status::ERROR);
+    } else {
+        finishRequest(*superseded, Status::SUCCESS);
+    }
+}
+
+void UsbGadget::functionsApplied(bool applied) {
+    std::optional<GadgetRequest> waiting;
+
+    mCurrentUsbFunctionsApplied = applied;
+    if (!applied) return;
+
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        if (mState == GadgetState::WAIT_FFS) enterStateLocked(GadgetState::PULLED_UP);
+        waiting = std::move(mWaiting);
+        mWaiting.reset();
+    }
+
+    if (waiting.has_value()) finishRequest(*waiting, Status::SUCCESS);
 }
 
 void currentFunctionsAppliedCallback(bool functionsApplied, void* payload) {
     UsbGadget* gadget = (UsbGadget*)payload;
-    gadget->mCurrentUsbFunctionsApplied = functionsApplied;
+    gadget->functionsApplied(functionsApplied);
+}
+
+// Nearest rank percentile of the samples, in microseconds.
+static int64_t percentileUs(std::vector<int64_t>& samples, int percent) {
+    size_t rank;
+
+    if (samples.empty()) return 0;
+    std::sort(samples.begin(), samples.end());
+    rank = (samples.size() * percent + 99) / 100;
+    return samples[rank ? rank - 1 : 0] / 1000;
 }
 
-Return<void> UsbGadget::getCurrentUsbFunctions(const sp<V1_0::IUsbGadgetCallback>& callback) {
-    Return<void> ret = callback->getCurrentUsbFunctionsCb(
-            mCurrentUsbFunctions, mCurrentUsbFunctionsApplied ? Status::FUNCTIONS_APPLIED
-                                                              : Status::FUNCTIONS_NOT_APPLIED);
-    if (!ret.isOk()) ALOGE("Call to getCurrentUsbFunctionsCb failed %s", ret.description().c_str());
+/*
+ * Reports how long the recent function switches spent in each phase, and
+ * end to end from pulling down to the final state. Only switches that
+ * reached pulled-up count towards the totals.
+ */
+binder_status_t UsbGadget::dump(int fd, const char** /* args */, uint32_t /* numArgs */) {
+    constexpr GadgetState kPhases[] = {GadgetState::TEARDOWN, GadgetState::CONFIGURE,
+                                       GadgetState::WAIT_FFS};
+    std::lock_guard<std::mutex> lock(mLock);
+    std::vector<int64_t> total;
+    std::string out;
+    size_t failed = 0;
+
+    out += StringPrintf("Current functions: %" PRIx64 " (%s)\n",
+                        static_cast<uint64_t>(mCurrentUsbFunctions),
+                        mCurrentUsbFunctionsApplied ? "applied" : "not applied");
+    out += StringPrintf("State: %s\n", stateName(mState));
+    out += StringPrintf("Speed: %d, host %s\n", static_cast<int>(mUsbSpeed.load()),
+                        mHostAttached ? "attached" : "not attached");
+
+    out += "Last switch:\n";
+    for (const auto& transition : mTransitions)
+        out += StringPrintf("  %-10s %" PRId64 ".%06" PRId64 "\n", stateName(transition.state),
+                            transition.timestampNs / 1000000000,
+                            (transition.timestampNs / 1000) % 1000000);
+
+    for (const auto& entry : mHistory) {
+        const auto& transitions = entry.transitions;
+        if (transitions.back().state == GadgetState::ERROR) failed++;
+        if (transitions.back().state != GadgetState::PULLED_UP) continue;
+        total.push_back(transitions.back().timestampNs - transitions.front().timestampNs);
+    }
+
+    out += StringPrintf("Switch latency over %zu switches, %zu failed (us):\n", mHistory.size(),
+                        failed);
+    out += StringPrintf("  %-10s %8s %8s %8s\n", "phase", "count", "p50", "p99");
+
+    for (GadgetState phase : kPhases) {
+        std::vector<int64_t> samples;
+
+        for (const auto& entry : mHistory) {
+            const auto& transitions = entry.transitions;
+            for (size_t i = 0; i + 1 < transitions.size(); i++) {
+                if (transitions[i].state == phase)
+                    samples.push_back(transitions[i + 1].timestampNs - transitions[i].timestampNs);
+            }
+        }
+
+        size_t count = samples.size();
+        int64_t p50 = percentileUs(samples, 50);
+        int64_t p99 = percentileUs(samples, 99);
+        out += StringPrintf("  %-10s %8zu %8" PRId64 " %8" PRId64 "\n", stateName(phase), count,
+                            p50, p99);
+    }
+
+    size_t count = total.size();
+    int64_t p50 = percentileUs(total, 50);
+    int64_t p99 = percentileUs(total, 99);
+    out += StringPrintf("  %-10s %8zu %8" PRId64 " %8" PRId64 "\n", "total", count, p50, p99);
 
-    return Void();
+    if (!WriteStringToFd(out, fd)) return STATUS_UNKNOWN_ERROR;
+    return STATUS_OK;
 }
 
-Return<void> UsbGadget::getUsbSpeed(const sp<V1_2::IUsbGadgetCallback>& callback) {
+ScopedAStatus UsbGadget::getCurrentUsbFunctions(const std::shared_ptr<IUsbGadgetCallback>& callback,
+                                                int64_t transactionId) {
+    if (callback == nullptr) return ScopedAStatus::fromExceptionCode(EX_NULL_POINTER);
+
+    ScopedAStatus ret = callback->getCurrentUsbFunctionsCb(
+            mCurrentUsbFunctions,
+            mCurrentUsbFunctionsApplied ? Status::FUNCTIONS_APPLIED : Status::FUNCTIONS_NOT_APPLIED,
+            transactionId);
+    if (!ret.isOk())
+        ALOGE("Call to getCurrentUsbFunctionsCb failed %s", ret.getDescription().c_str());
+
+    return ScopedAStatus::ok();
+}
+
+static bool isNetFunction(const std::string& name) {
+    return StartsWith(name, "ncm.") || StartsWith(name, "rndis.");
+}
+
+// ro.serialno, else the SoC serial the firmware puts in the device tree.
+static std::string boardSerial() {
+    std::string serial = GetProperty("ro.serialno", "");
+
+    if (serial.empty() &&
+        ReadFileToString("/sys/firmware/devicetree/base/serial-number", &serial))
+        serial = Trim(serial.c_str());  // NUL terminated property
+
+    return serial;
+}
+
+/*
+ * Locally administered MACs derived from the serial number, so the host
+ * keeps its interface name and DHCP lease across reboots and re-enumeration.
+ * Empty without a serial: a constant MAC would be shared by every board.
+ */
+static std::string netFunctionMac(bool host) {
+    std::string serial = boardSerial();
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    char mac[18];
+
+    if (serial.empty()) return "";
+
+    for (char c : serial) {
+        hash ^= static_cast<uint8_t>(c);
+        hash *= 0x100000001b3ULL;
+    }
+
+    snprintf(mac, sizeof(mac), "%02x:%02x:%02x:%02x:%02x:%02x", host ? 0x06 : 0x02,
+             static_cast<uint8_t>(hash >> 32), static_cast<uint8_t>(hash >> 24),
+             static_cast<uint8_t>(hash >> 16), static_cast<uint8_t>(hash >> 8),
+             static_cast<uint8_t>(hash));
+    return mac;
+}
+
+static void writeFunctionAttr(const std::string& function, const char* attr,
+                              const std::string& value) {
+    std::string path = std::string(FUNCTIONS_PATH) + function + "/" + attr;
+
+    if (!WriteStringToFile(value, path))
+        ALOGE("Unable to write %s to %s", value.c_str(), path.c_str());
+}
+
+// u_ether only accepts these while the function is not linked into a config.
+static void configureNetFunction(const std::string& name) {
+    std::string qmult = GetProperty("ro.vendor.usb.net.qmult", "");
+    std::string segment = GetProperty("ro.vendor.usb.ncm.max_segment_size", "");
+
+    if (access((std::string(FUNCTIONS_PATH) + name + "/dev_addr").c_str(), W_OK)) return;
+
+    // Without a serial u_ether keeps the random MACs it picked
+    if (std::string mac = netFunctionMac(false); !mac.empty()) {
+        writeFunctionAttr(name, "dev_addr", mac);
+        writeFunctionAttr(name, "host_addr", netFunctionMac(true));
+    }
+    if (!qmult.empty()) writeFunctionAttr(name, "qmult", qmult);
+    if (!segment.empty() && StartsWith(name, "ncm."))
+        writeFunctionAttr(name, "max_segment_size", segment);
+}
+
+/*
+ * Points LUN 0 at vendor.usb.mass_storage.file, a disk image under
+ * kMassStorageDir or a block device. An empty property leaves the medium
+ * ejected. f_mass_storage opens the backing file itself, with the
+ * credentials of the writer, so anything else the HAL can reach is refused;
+ * which block devices it can open is down to their SELinux label.
+ */
+static void configureMassStorage(const std::string& name) {
+    std::string file = GetProperty(kMassStorageFileProp, "");
+    std::string ro = GetProperty("vendor.usb.mass_storage.ro", "0");
+    char path[PATH_MAX];
+    struct stat st;
+
+    // ro can only change while no medium is loaded
+    writeFunctionAttr(name, "lun.0/file", "");
+    writeFunctionAttr(name, "lun.0/ro", ro);
+    if (file.empty()) return;
+
+    if (!realpath(file.c_str(), path) || stat(path, &st) ||
+        !((S_ISREG(st.st_mode) && StartsWith(path, kMassStorageDir)) ||
+          (S_ISBLK(st.st_mode) && StartsWith(path, kMassStorageBlockDir)))) {
+        ALOGE("%s is neither an image under %s nor a block device", file.c_str(),
+              kMassStorageDir);
+        return;
+    }
+    writeFunctionAttr(name, "lun.0/file", path);
+}
+
+/*
+ * The gadget interface only exists once a function has been bound. Spread
+ * its receive processing away from the CPU taking the dwc2 interrupt,
+ * ueventd hands rps_cpus to system when the queue appears.
+ */
+static void tuneNetInterfaces() {
+    std::string cpus = GetProperty("ro.vendor.usb.net.rps_cpus", "");
+    std::unique_ptr<DIR, decltype(&closedir)> dir(opendir(FUNCTIONS_PATH), closedir);
+    struct dirent* entry;
+
+    if (cpus.empty() || !dir) return;
+
+    while ((entry = readdir(dir.get())) != nullptr) {
+        std::string ifname;
+
+        if (!isNetFunction(entry->d_name)) continue;
+        if (!ReadFileToString(std::string(FUNCTIONS_PATH) + entry->d_name + "/ifname", &ifname))
+            continue;
+
+        ifname = Trim(ifname);
+        if (ifname.empty() || ifname[0] == '(') continue;
+
+        std::string path = "/sys/class/net/" + ifname + "/queues/rx-0/rps_cpus";
+        if (!WriteStringToFile(cpus, path))
+            ALOGE("Unable to set %s to %s", path.c_str(), cpus.c_str());
+    }
+}
+
+/*
+ * /proc/irq is only writable by init, which pins the dwc2 interrupt to
+ * ro.vendor.usb.irq_cpus once vendor.usb.irq names it.
+ */
+static void publishUdcInterrupt() {
+    std::string interrupts;
+
+    if (!ReadFileToString("/proc/interrupts", &interrupts)) return;
+
+    for (const std::string& line : Split(interrupts, "\n")) {
+        if (line.find(kGadgetName) == std::string::npos) continue;
+
+        std::string irq = Trim(line.substr(0, line.find(':')));
+        if (!irq.empty() && std::all_of(irq.begin(), irq.end(), ::isdigit))
+            SetProperty("vendor.usb.irq", irq);
+        return;
+    }
+
+    ALOGE("No %s interrupt", kGadgetName);
+}
+
+// current_speed strings as printed by the kernel's usb_speed_string()
+static const struct {
+    const char* name;
+    UsbSpeed speed;
+} kUsbSpeeds[] = {
+        {"low-speed", UsbSpeed::LOWSPEED},
+        {"full-speed", UsbSpeed::FULLSPEED},
+        {"high-speed", UsbSpeed::HIGHSPEED},
+        {"super-speed", UsbSpeed::SUPERSPEED},
+        {"super-speed-plus", UsbSpeed::SUPERSPEED_10Gb},
+        {"UNKNOWN", UsbSpeed::UNKNOWN},
+};
+
+static UsbSpeed readUsbSpeed() {
     std::string current_speed;
-    if (ReadFileToString(SPEED_PATH, &current_speed)) {
-        current_speed = Trim(current_speed);
-        ALOGI("current USB speed is %s", current_speed.c_str());
-        if (current_speed == "low-speed")
-            mUsbSpeed = UsbSpeed::LOWSPEED;
-        else if (current_speed == "full-speed")
-            mUsbSpeed = UsbSpeed::FULLSPEED;
-        else if (current_speed == "high-speed")
-            mUsbSpeed = UsbSpeed::HIGHSPEED;
-        else if (current_speed == "super-speed")
-            mUsbSpeed = UsbSpeed::SUPERSPEED;
-        else if (current_speed == "super-speed-plus")
-            mUsbSpeed = UsbSpeed::SUPERSPEED_10Gb;
-        else if (current_speed == "UNKNOWN")
-            mUsbSpeed = UsbSpeed::UNKNOWN;
-        else {
-            /**
-             * This part is used for USB4 or reserved speed.
-             *
-             * If reserved speed is detected, it needs to convert to other speeds.
-             * For example:
-             * If the bandwidth of new speed is 7G, adding new if
-             * statement and set mUsbSpeed to SUPERSPEED.
-             * If the bandwidth of new speed is 80G, adding new if
-             * statement and set mUsbSpeed to USB4_GEN3_40Gb.
-             */
-            mUsbSpeed = UsbSpeed::RESERVED_SPEED;
+
+    if (!ReadFileToString(SPEED_PATH, &current_speed)) {
+        ALOGE("Fail to read current speed");
+        return UsbSpeed::UNKNOWN;
+    }
+
+    current_speed = Trim(current_speed);
+    for (const auto& entry : kUsbSpeeds) {
+        if (current_speed == entry.name) return entry.speed;
+    }
+
+    return UsbSpeed::RESERVED_SPEED;
+}
+
+// Reads the UDC state from the attribute fd, true if a host is attached.
+static bool readHostAttached(int fd) {
+    char state[32];
+    ssize_t len = pread(fd, state, sizeof(state) - 1, 0);
+
+    // Without the state attribute assume the host is there
+    if (len <= 0) return true;
+    state[len] = '\0';
+    return Trim(state) != "not attached";
+}
+
+/*
+ * The UDC signals state changes with sysfs_notify() on its state attribute,
+ * which wakes EPOLLPRI. Each change refreshes the cached connection state
+ * and speed; a speed change is pushed to the last getUsbSpeed() callback.
+ */
+void UsbGadget::udcMonitor() {
+    struct epoll_event events[2];
+
+    while (true) {
+        int nfds = epoll_wait(mUdcEpollFd.get(), events, 2, -1);
+        if (nfds < 0) {
+            if (errno == EINTR) continue;
+            ALOGE("UDC monitor epoll_wait failed: %s", strerror(errno));
+            return;
         }
+
+        for (int i = 0; i < nfds; i++) {
+            if (events[i].data.fd == mUdcExitFd.get()) return;
+        }
+
+        updateUdcState();
+    }
+}
+
+void UsbGadget::updateUdcState() {
+    bool attached = readHostAttached(mUdcStateFd.get());
+    UsbSpeed speed = attached ? readUsbSpeed() : UsbSpeed::UNKNOWN;
+    std::shared_ptr<IUsbGadgetCallback> callback;
+    int64_t transactionId;
+
+    if (mHostAttached.exchange(attached) != attached) {
+        ALOGI("USB host %s", attached ? "attached" : "detached");
+        if (attached) tuneNetInterfaces();
+    }
+
+    if (mUsbSpeed.exchange(speed) == speed) return;
+
+    ALOGI("current USB speed is %d", static_cast<int>(speed));
+    {
+        std::lock_guard<std::mutex> lock(mSpeedCallbackLock);
+        callback = mSpeedCallback;
+        transactionId = mSpeedTransactionId;
+    }
+
+    if (callback) {
+        ScopedAStatus ret = callback->getUsbSpeedCb(speed, transactionId);
+        if (!ret.isOk()) ALOGE("Call to getUsbSpeedCb failed %s", ret.getDescription().c_str());
+    }
+}
+
+Status UsbGadget::startUdcMonitor() {
+    struct epoll_event event = {};
+
+    publishUdcInterrupt();
+
+    mUdcStateFd.reset(open(STATE_PATH, O_RDONLY | O_CLOEXEC));
+    mUdcExitFd.reset(eventfd(0, EFD_CLOEXEC));
+    mUdcEpollFd.reset(epoll_create1(EPOLL_CLOEXEC));
+    if (mUdcStateFd.get() < 0 || mUdcExitFd.get() < 0 || mUdcEpollFd.get() < 0) {
+        ALOGE("Unable to monitor %s: %s", STATE_PATH, strerror(errno));
+        return Status::ERROR;
+    }
+
+    event.events = EPOLLPRI | EPOLLERR;
+    event.data.fd = mUdcStateFd.get();
+    if (epoll_ctl(mUdcEpollFd.get(), EPOLL_CTL_ADD, mUdcStateFd.get(), &event))
+        return Status::ERROR;
+
+    if (addEpollFd(mUdcEpollFd, mUdcExitFd)) return Status::ERROR;
+
+    // Seed the cache, the attribute has to be read before it can notify
+    updateUdcState();
+    mUdcThread = std::thread(&UsbGadget::udcMonitor, this);
+    return Status::SUCCESS;
+}
+
+ScopedAStatus UsbGadget::getUsbSpeed(const std::shared_ptr<IUsbGadgetCallback>& callback,
+                                     int64_t transactionId) {
+    UsbSpeed speed;
+
+    if (mUdcThread.joinable()) {
+        speed = mUsbSpeed;
     } else {
-        ALOGE("Fail to read current speed");
-        mUsbSpeed = UsbSpeed::UNKNOWN;
+        speed = readUsbSpeed();
+        mUsbSpeed = speed;
     }
 
     if (callback) {
-        Return<void> ret = callback->getUsbSpeedCb(mUsbSpeed);
+        {
+            std::lock_guard<std::mutex> lock(mSpeedCallbackLock);
+            mSpeedCallback = callback;
+            mSpeedTransactionId = transactionId;
+        }
+
+        ScopedAStatus ret = callback->getUsbSpeedCb(speed, transactionId);
 
-        if (!ret.isOk()) ALOGE("Call to getUsbSpeedCb failed %s", ret.description().c_str());
+        if (!ret.isOk()) ALOGE("Call to getUsbSpeedCb failed %s", ret.getDescription().c_str());
     }
 
-    return Void();
+    return ScopedAStatus::ok();
 }
 
-V1_0::Status UsbGadget::tearDownGadget() {
-    if (resetGadget() != V1_0::Status::SUCCESS) return V1_0::Status::ERROR;
+Status UsbGadget::tearDownGadget() {
+    mLinkedFunctions.clear();
+    mLinkedFunctionsValid = false;
+
+    if (resetGadget() != V1_0::Status::SUCCESS) return Status::ERROR;
 
     if (monitorFfs.isMonitorRunning()) {
         monitorFfs.reset();
     } else {
         ALOGI("mMonitor not running");
     }
-    return V1_0::Status::SUCCESS;
+    return Status::SUCCESS;
 }
 
-Return<Status> UsbGadget::reset() {
+ScopedAStatus UsbGadget::reset(const std::shared_ptr<IUsbGadgetCallback>& callback,
+                               int64_t transactionId) {
+    queueRequest({GadgetRequest::RESET, 0, callback, 0, transactionId});
+    return ScopedAStatus::ok();
+}
+
+Status UsbGadget::pullDownAndUp() {
     if (!WriteStringToFile("none", PULLUP_PATH)) {
         ALOGI("Gadget cannot be pulled down");
         return Status::ERROR;
@@ -126,162 +652,486 @@ Return<Status> UsbGadget::reset() {
     return Status::SUCCESS;
 }
 
-static V1_0::Status validateAndSetVidPid(uint64_t functions) {
-    V1_0::Status ret = V1_0::Status::SUCCESS;
-
-    switch (functions) {
-        case static_cast<uint64_t>(V1_2::GadgetFunction::MTP):
-            ret = setVidPid("0x18d1", "0x4ee1");
-            break;
-        case V1_2::GadgetFunction::ADB | V1_2::GadgetFunction::MTP:
-            ret = setVidPid("0x18d1", "0x4ee2");
-            break;
-        case static_cast<uint64_t>(V1_2::GadgetFunction::RNDIS):
-            ret = setVidPid("0x18d1", "0x4ee3");
-            break;
-        case V1_2::GadgetFunction::ADB | V1_2::GadgetFunction::RNDIS:
-            ret = setVidPid("0x18d1", "0x4ee4");
-            break;
-        case static_cast<uint64_t>(V1_2::GadgetFunction::PTP):
-            ret = setVidPid("0x18d1", "0x4ee5");
-            break;
-        case V1_2::GadgetFunction::ADB | V1_2::GadgetFunction::PTP:
-            ret = setVidPid("0x18d1", "0x4ee6");
-            break;
-        case static_cast<uint64_t>(V1_2::GadgetFunction::ADB):
-            ret = setVidPid("0x18d1", "0x4ee7");
-            break;
-        case static_cast<uint64_t>(V1_2::GadgetFunction::MIDI):
-            ret = setVidPid("0x18d1", "0x4ee8");
-            break;
-        case V1_2::GadgetFunction::ADB | V1_2::GadgetFunction::MIDI:
-            ret = setVidPid("0x18d1", "0x4ee9");
-            break;
-        case static_cast<uint64_t>(V1_2::GadgetFunction::NCM):
-            ret = setVidPid("0x18d1", "0x4eeb");
-            break;
-        case V1_2::GadgetFunction::ADB | V1_2::GadgetFunction::NCM:
-            ret = setVidPid("0x18d1", "0x4eec");
-            break;
-        case static_cast<uint64_t>(V1_2::GadgetFunction::ACCESSORY):
-            ret = setVidPid("0x18d1", "0x2d00");
-            break;
-        case V1_2::GadgetFunction::ADB | V1_2::GadgetFunction::ACCESSORY:
-            ret = setVidPid("0x18d1", "0x2d01");
-            break;
-        case static_cast<uint64_t>(V1_2::GadgetFunction::AUDIO_SOURCE):
-            ret = setVidPid("0x18d1", "0x2d02");
-            break;
-        case V1_2::GadgetFunction::ADB | V1_2::GadgetFunction::AUDIO_SOURCE:
-            ret = setVidPid("0x18d1", "0x2d03");
-            break;
-        case V1_2::GadgetFunction::ACCESSORY | V1_2::GadgetFunction::AUDIO_SOURCE:
-            ret = setVidPid("0x18d1", "0x2d04");
-            break;
-        case V1_2::GadgetFunction::ADB | V1_2::GadgetFunction::ACCESSORY |
-                V1_2::GadgetFunction::AUDIO_SOURCE:
-            ret = setVidPid("0x18d1", "0x2d05");
-            break;
-        default:
-            ALOGE("Combination not supported");
-            ret = V1_0::Status::CONFIGURATION_NOT_SUPPORTED;
-    }
-    return ret;
-}
-
-V1_0::Status UsbGadget::setupFunctions(uint64_t functions,
-                                       const sp<V1_0::IUsbGadgetCallback>& callback,
-                                       uint64_t timeout) {
-    bool ffsEnabled = false;
-    int i = 0;
-
-    if (addGenericAndroidFunctions(&monitorFfs, functions, &ffsEnabled, &i) !=
-        V1_0::Status::SUCCESS)
-        return V1_0::Status::ERROR;
-
-    if ((functions & V1_2::GadgetFunction::ADB) != 0) {
-        ffsEnabled = true;
-        if (addAdb(&monitorFfs, &i) != V1_0::Status::SUCCESS) return V1_0::Status::ERROR;
-    }
-
-    // Pull up the gadget right away when there are no ffs functions.
-    if (!ffsEnabled) {
-        if (!WriteStringToFile(kGadgetName, PULLUP_PATH)) return V1_0::Status::ERROR;
-        mCurrentUsbFunctionsApplied = true;
-        if (callback) callback->setCurrentUsbFunctionsCb(functions, V1_0::Status::SUCCESS);
-        return V1_0::Status::SUCCESS;
+// Compositions that work without a config file, same ids as other Android devices.
+static const GadgetComposition kDefaultCompositions[] = {
+        {GadgetFunction::MTP, "0x18d1", "0x4ee1", {}},
+        {GadgetFunction::ADB | GadgetFunction::MTP, "0x18d1", "0x4ee2", {}},
+        {GadgetFunction::RNDIS, "0x18d1", "0x4ee3", {}},
+        {GadgetFunction::ADB | GadgetFunction::RNDIS, "0x18d1", "0x4ee4", {}},
+        {GadgetFunction::PTP, "0x18d1", "0x4ee5", {}},
+        {GadgetFunction::ADB | GadgetFunction::PTP, "0x18d1", "0x4ee6", {}},
+        {GadgetFunction::ADB, "0x18d1", "0x4ee7", {}},
+        {GadgetFunction::MIDI, "0x18d1", "0x4ee8", {}},
+        {GadgetFunction::ADB | GadgetFunction::MIDI, "0x18d1", "0x4ee9", {}},
+        {GadgetFunction::NCM, "0x18d1", "0x4eeb", {}},
+        {GadgetFunction::ADB | GadgetFunction::NCM, "0x18d1", "0x4eec", {}},
+        {GadgetFunction::ACCESSORY, "0x18d1", "0x2d00", {}},
+        {GadgetFunction::ADB | GadgetFunction::ACCESSORY, "0x18d1", "0x2d01", {}},
+        {GadgetFunction::AUDIO_SOURCE, "0x18d1", "0x2d02", {}},
+        {GadgetFunction::ADB | GadgetFunction::AUDIO_SOURCE, "0x18d1", "0x2d03", {}},
+        {GadgetFunction::ACCESSORY | GadgetFunction::AUDIO_SOURCE, "0x18d1", "0x2d04", {}},
+        {GadgetFunction::ADB | GadgetFunction::ACCESSORY | GadgetFunction::AUDIO_SOURCE, "0x18d1",
+         "0x2d05", {}},
+};
+
+static const struct {
+    const char* name;
+    uint64_t function;
+} kFunctionNames[] = {
+        {"adb", GadgetFunction::ADB},
+        {"accessory", GadgetFunction::ACCESSORY},
+        {"mtp", GadgetFunction::MTP},
+        {"midi", GadgetFunction::MIDI},
+        {"ptp", GadgetFunction::PTP},
+        {"rndis", GadgetFunction::RNDIS},
+        {"audio_source", GadgetFunction::AUDIO_SOURCE},
+        {"uvc", GadgetFunction::UVC},
+        {"ncm", GadgetFunction::NCM},
+};
+
+// Endpoints the ffs daemons create, MonitorFfs waits for all of them.
+static const struct {
+    const char* name;
+    int endpoints;
+} kFfsEndpoints[] = {
+        {"ffs.adb", 2},
+        {"ffs.mtp", 3},
+        {"ffs.ptp", 3},
+};
+
+static GadgetFunctionEntry functionEntry(const std::string& name) {
+    if (!StartsWith(name, "ffs.")) return {name, "", 0};
+
+    for (const auto& entry : kFfsEndpoints) {
+        if (name == entry.name)
+            return {name, "/dev/usb-ffs/" + name.substr(4) + "/", entry.endpoints};
     }
 
-    monitorFfs.registerFunctionsAppliedCallback(&currentFunctionsAppliedCallback, this);
-    // Monitors the ffs paths to pull up the gadget when descriptors are written.
-    // Also takes of the pulling up the gadget again if the userspace process
-    // dies and restarts.
-    monitorFfs.startMonitor();
+    return {name, "/dev/usb-ffs/" + name.substr(4) + "/", 0};
+}
 
-    if (kDebug) ALOGI("Mainthread in Cv");
+/*
+ * A configfs function from a compose line. ffs functions the table above
+ * does not know are written ffs.<name>:<endpoints>, without a count
+ * MonitorFfs would pull up before their daemon wrote its descriptors.
+ */
+static bool parseLink(const std::string& link, GadgetFunctionEntry* entry) {
+    std::vector<std::string> parts = Split(link, ":");
 
-    if (callback) {
-        bool pullup = monitorFfs.waitForPullUp(timeout);
-        Return<void> ret = callback->setCurrentUsbFunctionsCb(
-                functions, pullup ? V1_0::Status::SUCCESS : V1_0::Status::ERROR);
-        if (!ret.isOk()) ALOGE("setCurrentUsbFunctionsCb error %s", ret.description().c_str());
+    *entry = functionEntry(parts[0]);
+    if (parts.size() > 2 || (parts.size() == 2 && entry->ffsPath.empty())) return false;
+    if (parts.size() == 2 && !ParseInt(parts[1], &entry->endpoints, 1)) return false;
+
+    return entry->ffsPath.empty() || entry->endpoints > 0;
+}
+
+// idVendor and idProduct are written to configfs as given, 0x and up to four hex digits.
+static bool isUsbId(const std::string& id) {
+    uint16_t value;
+
+    return StartsWith(id, "0x") && id.size() <= 6 && ParseUint(id, &value);
+}
+
+static bool parseFunctions(const std::string& list, uint64_t* functions) {
+    *functions = 0;
+
+    for (const auto& name : Split(list, ",")) {
+        bool found = false;
+
+        for (const auto& entry : kFunctionNames) {
+            if (name == entry.name) {
+                *functions |= entry.function;
+                found = true;
+            }
+        }
+        if (!found) return false;
     }
 
-    return V1_0::Status::SUCCESS;
+    return true;
 }
 
-Return<void> UsbGadget::setCurrentUsbFunctions(uint64_t functions,
-                                               const sp<V1_0::IUsbGadgetCallback>& callback,
-                                               uint64_t timeout) {
-    std::unique_lock<std::mutex> lk(mLockSetCurrentFunction);
+/*
+ * Reads the vendor composition table. Each line is one of
+ *   compose <function>[,<function>...] <idVendor> <idProduct> [<configfs function>...]
+ *   set <configfs function> <attribute> <value>
+ * A compose line overrides the built in ids for that function set, and if it
+ * names configfs functions they are linked in that order instead of the
+ * default one, which also allows functions the framework does not know.
+ * Lines that reuse another set's ids or link an ffs function of unknown
+ * endpoint count are rejected.
+ * set lines are written to the function before it is linked.
+ */
+void UsbGadget::loadCompositions() {
+    std::string config;
+    int lineNumber = 0;
 
-    mCurrentUsbFunctions = functions;
+    mCompositions.assign(std::begin(kDefaultCompositions), std::end(kDefaultCompositions));
+
+    if (!ReadFileToString(kCompositionsPath, &config)) {
+        ALOGI("No %s, using the default compositions", kCompositionsPath);
+        return;
+    }
+
+    for (const auto& line : Split(config, "\n")) {
+        std::vector<std::string> fields;
+
+        lineNumber++;
+        for (const auto& field : Split(Trim(line), " \t")) {
+            if (!field.empty()) fields.push_back(field);
+        }
+        if (fields.empty() || fields[0][0] == '#') continue;
+
+        if (fields[0] == "compose" && fields.size() >= 4) {
+            GadgetComposition composition = {0, fields[2], fields[3], {}};
+
+            if (!parseFunctions(fields[1], &composition.functions)) {
+                ALOGE("%s:%d: unknown function in %s", kCompositionsPath, lineNumber,
+                      fields[1].c_str());
+                continue;
+            }
+            if (!isUsbId(composition.vid) || !isUsbId(composition.pid)) {
+                ALOGE("%s:%d: %s:%s is not a 16 bit hex VID:PID", kCompositionsPath, lineNumber,
+                      composition.vid.c_str(), composition.pid.c_str());
+                continue;
+            }
+            bool linksValid = true;
+            for (auto link = fields.begin() + 4; link != fields.end() && linksValid; ++link) {
+                GadgetFunctionEntry entry;
+
+                linksValid = parseLink(*link, &entry);
+                if (linksValid)
+                    composition.links.push_back(entry);
+                else
+                    ALOGE("%s:%d: bad function %s, ffs functions other than adb, mtp and ptp "
+                          "need an endpoint count", kCompositionsPath, lineNumber, link->c_str());
+            }
+            if (!linksValid) continue;
+
+            // Hosts cache drivers and descriptors by VID:PID
+            auto clash = std::find_if(mCompositions.begin(), mCompositions.end(),
+                                      [&](const GadgetComposition& entry) {
+                                          return entry.functions != composition.functions &&
+                                                 entry.vid == composition.vid &&
+                                                 entry.pid == composition.pid;
+                                      });
+            if (clash != mCompositions.end()) {
+                ALOGE("%s:%d: %s:%s is already used by another composition", kCompositionsPath,
+                      lineNumber, composition.vid.c_str(), composition.pid.c_str());
+                continue;
+            }
+
+            auto it = std::find_if(mCompositions.begin(), mCompositions.end(),
+                                   [&](const GadgetComposition& entry) {
+                                       return entry.functions == composition.functions;
+                                   });
+            if (it != mCompositions.end())
+                *it = composition;
+            else
+                mCompositions.push_back(composition);
+        } else if (fields[0] == "set" && fields.size() == 4) {
+            mTunables.push_back({fields[1], fields[2], fields[3]});
+        } else {
+            ALOGE("%s:%d: cannot parse \"%s\"", kCompositionsPath, lineNumber, line.c_str());
+        }
+    }
+
+    ALOGI("Loaded %zu compositions, %zu tunables", mCompositions.size(), mTunables.size());
+}
+
+const GadgetComposition* UsbGadget::findComposition(uint64_t functions) const {
+    for (const auto& composition : mCompositions) {
+        if (composition.functions == functions) return &composition;
+    }
+
+    return nullptr;
+}
+
+// Same functions and order as addGenericAndroidFunctions() and addAdb(), ADB last.
+static std::vector<GadgetFunctionEntry> gadgetFunctions(const GadgetComposition& composition) {
+    uint64_t functions = composition.functions;
+    std::vector<GadgetFunctionEntry> entries;
+
+    if (!composition.links.empty()) return composition.links;
+
+    if ((functions & GadgetFunction::MTP) != 0)
+        entries.push_back(functionEntry("ffs.mtp"));
+    else if ((functions & GadgetFunction::PTP) != 0)
+        entries.push_back(functionEntry("ffs.ptp"));
+    if ((functions & GadgetFunction::MIDI) != 0) entries.push_back(functionEntry("midi.gs5"));
+    if ((functions & GadgetFunction::ACCESSORY) != 0)
+        entries.push_back(functionEntry("accessory.gs2"));
+    if ((functions & GadgetFunction::AUDIO_SOURCE) != 0)
+        entries.push_back(functionEntry("audio_source.gs3"));
+    if ((functions & GadgetFunction::RNDIS) != 0)
+        entries.push_back(functionEntry(GetProperty("vendor.usb.rndis.config", "gsi.rndis")));
+    if ((functions & GadgetFunction::NCM) != 0) entries.push_back(functionEntry("ncm.gs6"));
+    if ((functions & GadgetFunction::ADB) != 0) entries.push_back(functionEntry("ffs.adb"));
+
+    return entries;
+}
+
+static std::vector<GadgetFunctionEntry> ffsFunctions(
+        const std::vector<GadgetFunctionEntry>& entries) {
+    std::vector<GadgetFunctionEntry> ffs;
+
+    for (const auto& entry : entries) {
+        if (!entry.ffsPath.empty()) ffs.push_back(entry);
+    }
+
+    return ffs;
+}
+
+static bool isPulledUp() {
+    std::string udc;
+
+    return ReadFileToString(PULLUP_PATH, &udc) && !Trim(udc).empty() && Trim(udc) != "none";
+}
+
+// Links are named function<position>, as linkFunction() and unlinkFunctions() expect.
+Status UsbGadget::relinkFunctions(const std::vector<GadgetFunctionEntry>& functions) {
+    size_t keep = 0;
+
+    if (mLinkedFunctionsValid) {
+        while (keep < mLinkedFunctions.size() && keep < functions.size() &&
+               mLinkedFunctions[keep] == functions[keep])
+            keep++;
+
+        for (size_t i = keep; i < mLinkedFunctions.size(); i++) {
+            std::string link = std::string(FUNCTION_PATH) + std::to_string(i);
+            if (remove(link.c_str())) {
+                ALOGE("Unable to remove %s: %s", link.c_str(), strerror(errno));
+                return Status::ERROR;
+            }
+        }
+    } else {
+        if (unlinkFunctions(CONFIG_PATH)) return Status::ERROR;
+    }
+
+    mLinkedFunctions.resize(keep);
+    mLinkedFunctionsValid = true;
+
+    for (size_t i = keep; i < functions.size(); i++) {
+        ALOGI("setCurrentUsbFunctions %s", functions[i].name.c_str());
+        if (isNetFunction(functions[i].name)) configureNetFunction(functions[i].name);
+        if (StartsWith(functions[i].name, "mass_storage."))
+            configureMassStorage(functions[i].name);
+        for (const auto& tunable : mTunables) {
+            if (tunable.function == functions[i].name)
+                writeFunctionAttr(tunable.function, tunable.attribute.c_str(), tunable.value);
+        }
+        if (linkFunction(functions[i].name.c_str(), i)) {
+            mLinkedFunctionsValid = false;
+            return Status::ERROR;
+        }
+        mLinkedFunctions.push_back(functions[i]);
+    }
+
+    if (kDebug) ALOGI("Kept %zu functions, linked %zu", keep, functions.size() - keep);
+
+    return Status::SUCCESS;
+}
+
+// Loads a changed medium into the linked mass storage function, without a switch.
+void UsbGadget::reloadMassStorage() {
+    if (!mLinkedFunctionsValid) return;
+
+    for (const auto& function : mLinkedFunctions) {
+        if (StartsWith(function.name, "mass_storage.")) configureMassStorage(function.name);
+    }
+}
+
+/*
+ * Hands changes of kMassStorageFileProp to mWorker. Property waits cannot be
+ * interrupted, they time out every second to check mMassStorageExit.
+ */
+void UsbGadget::massStorageMonitor() {
+    const struct timespec timeout = {1, 0};
+    const prop_info* pi = __system_property_find(kMassStorageFileProp);
+    uint32_t serial = pi ? __system_property_serial(pi) : 0;
+
+    while (!mMassStorageExit) {
+        if (pi == nullptr) {
+            // Not set yet, any property change may be the one creating it
+            uint32_t area = __system_property_area_serial();
+            pi = __system_property_find(kMassStorageFileProp);
+            if (pi == nullptr) {
+                __system_property_wait(nullptr, area, &area, &timeout);
+                continue;
+            }
+            serial = __system_property_serial(pi);
+        } else if (!__system_property_wait(pi, serial, &serial, &timeout)) {
+            continue;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mLock);
+            mMassStorageChanged = true;
+        }
+        mCv.notify_one();
+    }
+}
+
+Status UsbGadget::setupFunctions(const GadgetRequest& request,
+                                 const std::vector<GadgetFunctionEntry>& entries,
+                                 bool restartMonitor) {
+    std::vector<GadgetFunctionEntry> ffs = ffsFunctions(entries);
+
+    // Pull up the gadget right away when there are no ffs functions, or when
+    // the ffs daemons kept their descriptors across an unchanged ffs set.
+    if (ffs.empty() || (!restartMonitor && monitorFfs.isMonitorRunning() &&
+                        mCurrentUsbFunctionsApplied)) {
+        if (!WriteStringToFile(kGadgetName, PULLUP_PATH)) return Status::ERROR;
+        mCurrentUsbFunctionsApplied = true;
+        enterState(GadgetState::PULLED_UP);
+        finishRequest(request, Status::SUCCESS);
+        return Status::SUCCESS;
+    }
+
+    // Park the request before the monitor can pull up and look for it
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        enterStateLocked(GadgetState::WAIT_FFS);
+        mWaiting = request;
+        mWaitDeadline = std::chrono::steady_clock::now() +
+                        std::chrono::milliseconds(request.timeoutMs);
+    }
     mCurrentUsbFunctionsApplied = false;
 
-    // Unlink the gadget and stop the monitor if running.
-    V1_0::Status status = tearDownGadget();
-    if (status != V1_0::Status::SUCCESS) {
-        goto error;
+    if (restartMonitor || !monitorFfs.isMonitorRunning()) {
+        monitorFfs.reset();
+
+        for (const auto& entry : ffs) {
+            if (!monitorFfs.addInotifyFd(entry.ffsPath)) {
+                std::lock_guard<std::mutex> lock(mLock);
+                mWaiting.reset();
+                return Status::ERROR;
+            }
+            for (int ep = 1; ep <= entry.endpoints; ep++)
+                monitorFfs.addEndPoint(entry.ffsPath + "ep" + std::to_string(ep));
+        }
+
+        monitorFfs.registerFunctionsAppliedCallback(&currentFunctionsAppliedCallback, this);
+        // Monitors the ffs paths to pull up the gadget when descriptors are written.
+        // Also takes of the pulling up the gadget again if the userspace process
+        // dies and restarts.
+        monitorFfs.startMonitor();
     }
 
-    ALOGI("Returned from tearDown gadget");
+    if (kDebug) ALOGI("Waiting for ffs descriptors");
 
-    // Leave the gadget pulled down to give time for the host to sense disconnect.
-    usleep(kDisconnectWaitUs);
+    return Status::SUCCESS;
+}
+
+ScopedAStatus UsbGadget::setCurrentUsbFunctions(int64_t functions,
+                                                const std::shared_ptr<IUsbGadgetCallback>& callback,
+                                                int64_t timeoutMs, int64_t transactionId) {
+    queueRequest({GadgetRequest::SET_FUNCTIONS, static_cast<uint64_t>(functions), callback,
+                  timeoutMs, transactionId});
+    return ScopedAStatus::ok();
+}
+
+void UsbGadget::applyFunctions(const GadgetRequest& request) {
+    uint64_t functions = request.functions;
+    const GadgetComposition* composition = findComposition(functions);
+    std::vector<GadgetFunctionEntry> entries;
+    std::vector<GadgetFunctionEntry> linked = mLinkedFunctions;
+    std::optional<GadgetRequest> waiting;
+    Status status = Status::SUCCESS;
+    bool restartMonitor;
+    bool disconnectWait;
+
+    // Nothing changes on the bus, just confirm
+    if (functions == mCurrentUsbFunctions && mCurrentUsbFunctionsApplied &&
+        mLinkedFunctionsValid && isPulledUp()) {
+        ALOGI("Usb Gadget functions unchanged");
+        finishRequest(request, Status::SUCCESS);
+        return;
+    }
+
+    if (composition == nullptr && functions != static_cast<uint64_t>(GadgetFunction::NONE)) {
+        ALOGE("Combination not supported");
+        finishRequest(request, Status::CONFIGURATION_NOT_SUPPORTED);
+        return;
+    }
+    if (composition != nullptr) entries = gadgetFunctions(*composition);
+
+    // A switch still waiting for its ffs daemons loses to this one
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        waiting = std::move(mWaiting);
+        mWaiting.reset();
+        mTransitions.clear();
+        enterStateLocked(GadgetState::TEARDOWN);
+    }
+    if (waiting.has_value()) finishRequest(*waiting, Status::ERROR);
+
+    // The host only needs time to sense a disconnect if it saw the gadget at all
+    disconnectWait = isPulledUp() && mHostAttached;
+    restartMonitor = !mLinkedFunctionsValid || ffsFunctions(linked) != ffsFunctions(entries);
+
+    mCurrentUsbFunctions = functions;
+
+    // Links can only change while the gadget is unbound.
+    if (isPulledUp() && !WriteStringToFile("none", PULLUP_PATH))
+        ALOGI("Gadget cannot be pulled down");
+    auto pulledDown = std::chrono::steady_clock::now();
+
+    if (restartMonitor) {
+        // Stop the monitor, the ffs set it watches is going away.
+        if (monitorFfs.isMonitorRunning()) monitorFfs.reset();
+        mCurrentUsbFunctionsApplied = false;
+    }
 
-    if (functions == static_cast<uint64_t>(V1_2::GadgetFunction::NONE)) {
-        if (callback == NULL) return Void();
-        Return<void> ret = callback->setCurrentUsbFunctionsCb(functions, V1_0::Status::SUCCESS);
-        if (!ret.isOk())
-            ALOGE("Error while calling setCurrentUsbFunctionsCb %s", ret.description().c_str());
-        return Void();
+    if (functions == static_cast<uint64_t>(GadgetFunction::NONE)) {
+        status = tearDownGadget();
+        if (status != Status::SUCCESS) goto error;
+        mCurrentUsbFunctionsApplied = false;
+        enterState(GadgetState::IDLE);
+        finishRequest(request, Status::SUCCESS);
+        return;
     }
 
-    status = validateAndSetVidPid(functions);
+    enterState(GadgetState::CONFIGURE);
 
-    if (status != V1_0::Status::SUCCESS) {
+    if (setVidPid(composition->vid.c_str(), composition->pid.c_str()) != V1_0::Status::SUCCESS) {
+        status = Status::ERROR;
         goto error;
     }
 
-    status = setupFunctions(functions, callback, timeout);
-    if (status != V1_0::Status::SUCCESS) {
+    status = relinkFunctions(entries);
+    if (status != Status::SUCCESS) goto error;
+
+    // MTP and PTP carry the Microsoft OS descriptors
+    if (!WriteStringToFile((functions & (GadgetFunction::MTP | GadgetFunction::PTP))
+                                   ? "1" : "0",
+                           DESC_USE_PATH)) {
+        status = Status::ERROR;
         goto error;
     }
 
+    if (disconnectWait) {
+        // Leave the gadget pulled down long enough for the host to sense disconnect.
+        auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - pulledDown);
+        if (elapsed.count() < kDisconnectWaitUs) usleep(kDisconnectWaitUs - elapsed.count());
+    }
+
+    status = setupFunctions(request, entries, restartMonitor);
+    if (status != Status::SUCCESS) goto error;
+
     ALOGI("Usb Gadget setcurrent functions called successfully");
-    return Void();
+    return;
 
 error:
     ALOGI("Usb Gadget setcurrent functions failed");
-    if (callback == NULL) return Void();
-    Return<void> ret = callback->setCurrentUsbFunctionsCb(functions, status);
-    if (!ret.isOk())
-        ALOGE("Error while calling setCurrentUsbFunctionsCb %s", ret.description().c_str());
-    return Void();
+    // Leave a clean slate, the next request rebuilds from scratch.
+    tearDownGadget();
+    mCurrentUsbFunctionsApplied = false;
+    enterState(GadgetState::ERROR);
+    finishRequest(request, status);
 }
-}  // namespace implementation
-}  // namespace V1_2
 }  // namespace gadget
 }  // namespace usb
 }  // namespace hardware
 }  // namespace android
+}  // namespace aidl
@@ -15,50 +15,52 @@
  * limitations under the License.
  */
 
-#ifndef ANDROID_HARDWARE_USB_GADGET_V1_2_USBGADGET_H
-#define ANDROID_HARDWARE_USB_GADGET_V1_2_USBGADGET_H
+#pragma once
 
 #include <UsbGadgetCommon.h>
+#include <aidl/android/hardware/usb/gadget/BnUsbGadget.h>
+#include <aidl/android/hardware/usb/gadget/GadgetFunction.h>
+#include <aidl/android/hardware/usb/gadget/IUsbGadgetCallback.h>
+#include <aidl/android/hardware/usb/gadget/Status.h>
+#include <aidl/android/hardware/usb/gadget/UsbSpeed.h>
 #include <android-base/file.h>
+#include <android-base/parseint.h>
 #include <android-base/properties.h>
+#include <android-base/stringprintf.h>
 #include <android-base/strings.h>
 #include <android-base/unique_fd.h>
-#include <android/hardware/usb/gadget/1.2/IUsbGadget.h>
-#include <android/hardware/usb/gadget/1.2/types.h>
-#include <hidl/MQDescriptor.h>
-#include <hidl/Status.h>
 #include <sys/epoll.h>
 #include <sys/eventfd.h>
 #include <utils/Log.h>
 #include <chrono>
 #include <condition_variable>
+#include <atomic>
+#include <deque>
 #include <mutex>
+#include <optional>
 #include <string>
 #include <thread>
+#include <vector>
 
+namespace aidl {
 namespace android {
 namespace hardware {
 namespace usb {
 namespace gadget {
-namespace V1_2 {
-namespace implementation {
 
-using ::android::sp;
 using ::android::base::GetProperty;
+using ::android::base::ParseInt;
+using ::android::base::ParseUint;
 using ::android::base::ReadFileToString;
 using ::android::base::SetProperty;
+using ::android::base::Split;
+using ::android::base::StartsWith;
+using ::android::base::StringPrintf;
 using ::android::base::Trim;
 using ::android::base::unique_fd;
+using ::android::base::WriteStringToFd;
 using ::android::base::WriteStringToFile;
-using ::android::hardware::hidl_array;
-using ::android::hardware::hidl_memory;
-using ::android::hardware::hidl_string;
-using ::android::hardware::hidl_vec;
-using ::android::hardware::Return;
-using ::android::hardware::Void;
-using ::android::hardware::usb::gadget::addAdb;
 using ::android::hardware::usb::gadget::addEpollFd;
-using ::android::hardware::usb::gadget::getVendorFunctions;
 using ::android::hardware::usb::gadget::kDebug;
 using ::android::hardware::usb::gadget::kDisconnectWaitUs;
 using ::android::hardware::usb::gadget::linkFunction;
@@ -66,44 +68,174 @@ using ::android::hardware::usb::gadget::MonitorFfs;
 using ::android::hardware::usb::gadget::resetGadget;
 using ::android::hardware::usb::gadget::setVidPid;
 using ::android::hardware::usb::gadget::unlinkFunctions;
+using ::ndk::ScopedAStatus;
 using ::std::string;
 
+// The configfs helpers still report the HIDL status, same values as Status.
+namespace V1_0 = ::android::hardware::usb::gadget::V1_0;
+
 constexpr char kGadgetName[] = "fe980000.usb";
 static MonitorFfs monitorFfs(kGadgetName);
 
 #define UDC_PATH "/sys/class/udc/fe980000.usb/"
 #define SPEED_PATH UDC_PATH "current_speed"
+#define STATE_PATH UDC_PATH "state"
+
+// A configfs function the gadget can link, in the order it is linked.
+struct GadgetFunctionEntry {
+    std::string name;      // directory under FUNCTIONS_PATH
+    std::string ffsPath;   // functionfs mount point, empty for kernel functions
+    int endpoints;         // endpoints the ffs daemon creates
+
+    bool operator==(const GadgetFunctionEntry& other) const {
+        return name == other.name && ffsPath == other.ffsPath;
+    }
+};
+
+constexpr char kCompositionsPath[] = "/vendor/etc/usb_gadget_compositions.conf";
+constexpr char kMassStorageDir[] = "/data/vendor/usb/";
+constexpr char kMassStorageBlockDir[] = "/dev/block/";
+constexpr char kMassStorageFileProp[] = "vendor.usb.mass_storage.file";
+
+// A supported function set and the gadget that implements it.
+struct GadgetComposition {
+    uint64_t functions;
+    std::string vid;
+    std::string pid;
+    std::vector<GadgetFunctionEntry> links;  // in link order, empty for the default
+};
 
-struct UsbGadget : public IUsbGadget {
+// A configfs attribute written before its function is linked.
+struct GadgetTunable {
+    std::string function;
+    std::string attribute;
+    std::string value;
+};
+
+// Work for the configuration thread.
+struct GadgetRequest {
+    enum Type { SET_FUNCTIONS, RESET } type;
+    uint64_t functions;
+    std::shared_ptr<IUsbGadgetCallback> callback;
+    int64_t timeoutMs;
+    int64_t transactionId;
+};
+
+// Phases of a function switch, in the order a switch goes through them.
+enum class GadgetState {
+    IDLE,       // no functions linked
+    TEARDOWN,   // pulled down, stale links and ffs monitor going away
+    CONFIGURE,  // ids, links and os descriptors being written
+    WAIT_FFS,   // waiting for the ffs daemons to write their descriptors
+    PULLED_UP,  // bound to the UDC
+    ERROR,      // last switch failed, gadget torn down
+};
+
+struct GadgetTransition {
+    GadgetState state;
+    int64_t timestampNs;  // CLOCK_MONOTONIC
+};
+
+// A finished switch, kept for the latency statistics in dump().
+struct GadgetSwitch {
+    uint64_t functions;
+    std::vector<GadgetTransition> transitions;
+};
+
+constexpr size_t kSwitchHistory = 128;
+
+struct UsbGadget : public BnUsbGadget {
     UsbGadget();
+    ~UsbGadget();
 
-    // Makes sure that only one request is processed at a time.
-    std::mutex mLockSetCurrentFunction;
-    uint64_t mCurrentUsbFunctions;
-    bool mCurrentUsbFunctionsApplied;
-    UsbSpeed mUsbSpeed;
+    std::atomic<uint64_t> mCurrentUsbFunctions;
+    std::atomic<bool> mCurrentUsbFunctionsApplied;
+    std::atomic<UsbSpeed> mUsbSpeed;
+    std::atomic<bool> mHostAttached;
 
-    Return<void> setCurrentUsbFunctions(uint64_t functions,
-                                        const sp<V1_0::IUsbGadgetCallback>& callback,
-                                        uint64_t timeout) override;
+    ScopedAStatus setCurrentUsbFunctions(int64_t functions,
+                                         const std::shared_ptr<IUsbGadgetCallback>& callback,
+                                         int64_t timeoutMs, int64_t transactionId) override;
 
-    Return<void> getCurrentUsbFunctions(const sp<V1_0::IUsbGadgetCallback>& callback) override;
+    ScopedAStatus getCurrentUsbFunctions(const std::shared_ptr<IUsbGadgetCallback>& callback,
+                                         int64_t transactionId) override;
 
-    Return<Status> reset() override;
+    ScopedAStatus reset(const std::shared_ptr<IUsbGadgetCallback>& callback,
+                        int64_t transactionId) override;
 
-    Return<void> getUsbSpeed(const sp<V1_2::IUsbGadgetCallback>& callback) override;
+    ScopedAStatus getUsbSpeed(const std::shared_ptr<IUsbGadgetCallback>& callback,
+                              int64_t transactionId) override;
+
+    binder_status_t dump(int fd, const char** args, uint32_t numArgs) override;
+
+    // MonitorFfs pulled the gadget up, or lost the ffs descriptors.
+    void functionsApplied(bool applied);
 
   private:
-    V1_0::Status tearDownGadget();
-    V1_0::Status setupFunctions(uint64_t functions, const sp<V1_0::IUsbGadgetCallback>& callback,
-                                uint64_t timeout);
+    void loadCompositions();
+    const GadgetComposition* findComposition(uint64_t functions) const;
+    Status startUdcMonitor();
+    void udcMonitor();
+    void updateUdcState();
+    void worker();
+    void queueRequest(GadgetRequest request);
+    void enterStateLocked(GadgetState state);
+    void enterState(GadgetState state);
+    void expireWaitLocked(std::unique_lock<std::mutex>& lock);
+    void finishRequest(const GadgetRequest& request, Status status);
+    void applyFunctions(const GadgetRequest& request);
+    Status pullDownAndUp();
+    Status tearDownGadget();
+    Status relinkFunctions(const std::vector<GadgetFunctionEntry>& functions);
+    Status setupFunctions(const GadgetRequest& request,
+                          const std::vector<GadgetFunctionEntry>& entries, bool restartMonitor);
+    void massStorageMonitor();
+    void reloadMassStorage();
+
+    // Composition table, fixed after the constructor.
+    std::vector<GadgetComposition> mCompositions;
+    std::vector<GadgetTunable> mTunables;
+
+    // Functions currently linked into the config, in link order. Only
+    // trusted while mLinkedFunctionsValid, else the next switch rebuilds.
+    std::vector<GadgetFunctionEntry> mLinkedFunctions;
+    bool mLinkedFunctionsValid;
+
+    // Requests run one at a time on mWorker so binder calls never wait for
+    // the bus. Only the latest request not yet started is kept, it
+    // supersedes whatever was pending.
+    std::mutex mLock;
+    std::condition_variable mCv;
+    std::optional<GadgetRequest> mPending;
+    bool mMassStorageChanged;  // the medium is reloaded on mWorker between requests
+    bool mExit;
+    std::thread mWorker;
+
+    // Switch state machine, guarded by mLock. mTransitions holds the
+    // phases of the latest switch. A request whose ffs functions are not
+    // up yet parks in mWaiting until MonitorFfs pulls up or it times out.
+    GadgetState mState;
+    std::vector<GadgetTransition> mTransitions;
+    std::deque<GadgetSwitch> mHistory;
+    std::optional<GadgetRequest> mWaiting;
+    std::chrono::steady_clock::time_point mWaitDeadline;
+
+    // UDC state cache, kept current by mUdcThread.
+    unique_fd mUdcStateFd;
+    unique_fd mUdcEpollFd;
+    unique_fd mUdcExitFd;
+    std::thread mUdcThread;
+    std::mutex mSpeedCallbackLock;
+    std::shared_ptr<IUsbGadgetCallback> mSpeedCallback;
+    int64_t mSpeedTransactionId;
+
+    // Follows kMassStorageFileProp, polls mMassStorageExit between waits.
+    std::atomic<bool> mMassStorageExit;
+    std::thread mMassStorageThread;
 };
 
-}  // namespace implementation
-}  // namespace V1_2
 }  // namespace gadget
 }  // namespace usb
 }  // namespace hardware
 }  // namespace android
-
-#endif  // ANDROID_HARDWARE_USB_V1_2_USBGADGET_H
+}  // namespace aidl
@@ -0,0 +1,127 @@
+/*
+ * Copyright (C) 2023 KonstaKANG
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "DummyGadget.h"
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/strings.h>
+#include <dirent.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <memory>
+
+using ::android::base::StartsWith;
+using ::android::base::WriteStringToFile;
+
+static const std::string kGadgetRoot = "/config/usb_gadget/benchmark/";
+static const std::string kConfig = kGadgetRoot + "configs/b.1/";
+
+static bool writeAttr(const std::string& path, const std::string& value) {
+    if (WriteStringToFile(value, path)) return true;
+    PLOG(ERROR) << "Unable to write " << value << " to " << path;
+    return false;
+}
+
+std::string DummyGadget::findUdc() {
+    std::unique_ptr<DIR, decltype(&closedir)> dir(opendir("/sys/class/udc"), closedir);
+    struct dirent* entry;
+
+    while (dir && (entry = readdir(dir.get())) != nullptr) {
+        if (StartsWith(entry->d_name, "dummy_udc")) return entry->d_name;
+    }
+    return "";
+}
+
+bool DummyGadget::start(const std::string& udc, const std::string& function,
+                        const std::string& vid, const std::string& pid,
+                        const std::vector<std::pair<std::string, std::string>>& attributes) {
+    std::string functionPath = kGadgetRoot + "functions/" + function;
+
+    stop();
+    mFunction = function;
+
+    if (mkdir(kGadgetRoot.c_str(), 0770) && errno != EEXIST) {
+        PLOG(ERROR) << "Unable to create " << kGadgetRoot;
+        return false;
+    }
+    mCreated = true;
+
+    if (!writeAttr(kGadgetRoot + "idVendor", vid) || !writeAttr(kGadgetRoot + "idProduct", pid))
+        return false;
+    if (mkdir(kConfig.c_str(), 0770) && errno != EEXIST) {
+        PLOG(ERROR) << "Unable to create " << kConfig;
+        return false;
+    }
+
+    if (mkdir(functionPath.c_str(), 0770) && errno != EEXIST) {
+        PLOG(ERROR) << "Unable to create " << functionPath;
+        return false;
+    }
+    mFunctionCreated = true;
+
+    for (const auto& [attribute, value] : attributes) {
+        if (!writeAttr(functionPath + "/" + attribute, value)) return false;
+    }
+
+    if (symlink(functionPath.c_str(), (kConfig + function).c_str())) {
+        PLOG(ERROR) << "Unable to link " << function;
+        return false;
+    }
+    mLinked = true;
+
+    if (!writeAttr(kGadgetRoot + "UDC", udc)) return false;
+    mBound = true;
+    return true;
+}
+
+void DummyGadget::stop() {
+    if (mBound) writeAttr(kGadgetRoot + "UDC", "");
+    if (mLinked) unlink((kConfig + mFunction).c_str());
+    if (mFunctionCreated) rmdir((kGadgetRoot + "functions/" + mFunction).c_str());
+    if (mCreated) {
+        rmdir(kConfig.c_str());
+        rmdir(kGadgetRoot.c_str());
+    }
+    mBound = mLinked = mFunctionCreated = mCreated = false;
+}
+
+std::string DummyGadget::functionPath() const {
+    return kGadgetRoot + "functions/" + mFunction + "/";
+}
+
+std::string DummyGadget::waitForHostDevice(const std::string& classPath, int timeoutMs) {
+    for (int waited = 0; waited < timeoutMs; waited += 10) {
+        std::unique_ptr<DIR, decltype(&closedir)> dir(opendir(classPath.c_str()), closedir);
+        struct dirent* entry;
+        char path[PATH_MAX];
+
+        while (dir && (entry = readdir(dir.get())) != nullptr) {
+            std::string device = classPath + entry->d_name;
+
+            // Whole disks only, partitions have a partition attribute
+            if (entry->d_name[0] == '.' || !access((device + "/partition").c_str(), F_OK))
+                continue;
+            if (realpath(device.c_str(), path) && strstr(path, "/dummy_hcd")) return entry->d_name;
+        }
+        usleep(10000);
+    }
+    return "";
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2023 KonstaKANG
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <string>
+#include <utility>
+#include <vector>
+
+/*
+ * A configfs gadget of its own bound to a dummy_hcd UDC, so one function can
+ * be driven from the host side of the same kernel. It leaves g1 and the dwc2
+ * UDC the HAL owns alone. Needs a kernel with CONFIG_USB_DUMMY_HCD.
+ */
+class DummyGadget {
+  public:
+    ~DummyGadget() { stop(); }
+
+    // The first dummy_hcd UDC, empty if the kernel has none.
+    static std::string findUdc();
+
+    // Creates the gadget with function as its only link, writes attributes
+    // to the function first and binds it to udc.
+    bool start(const std::string& udc, const std::string& function, const std::string& vid,
+               const std::string& pid,
+               const std::vector<std::pair<std::string, std::string>>& attributes);
+    void stop();
+
+    std::string functionPath() const;
+
+    // Waits for a device of classPath (/sys/class/net/, /sys/class/block/)
+    // that the host side of dummy_hcd enumerated. Returns its name.
+    static std::string waitForHostDevice(const std::string& classPath, int timeoutMs);
+
+  private:
+    std::string mFunction;
+    bool mCreated = false;
+    bool mFunctionCreated = false;
+    bool mLinked = false;
+    bool mBound = false;
+};
@@ -0,0 +1,206 @@
+/*
+ * Copyright (C) 2023 KonstaKANG
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Times setCurrentUsbFunctions end to end against the running gadget HAL,
+ * from the binder call until setCurrentUsbFunctionsCb, alternating between
+ * two compositions. Each repetition is one switch so the p50/p99 aggregates
+ * are per switch. The per phase breakdown kept by the HAL is printed after
+ * the run.
+ *
+ * UsbDeviceManager can issue its own switch at any time, so the framework
+ * has to be stopped for the run. Every switch also re-enumerates the gadget
+ * on whatever host is attached, run it as root over network adb:
+ *   adb connect <ip>
+ *   adb shell stop
+ *   adb shell /data/benchmarktest/usb_gadget_switch_benchmark/usb_gadget_switch_benchmark
+ *   adb shell start
+ * The pairs below use the built in compositions unless a product overrides
+ * them in usb_gadget_compositions.conf.
+ */
+
+#include <aidl/android/hardware/usb/gadget/BnUsbGadgetCallback.h>
+#include <aidl/android/hardware/usb/gadget/GadgetFunction.h>
+#include <aidl/android/hardware/usb/gadget/IUsbGadget.h>
+#include <android-base/properties.h>
+#include <android/binder_manager.h>
+#include <android/binder_process.h>
+#include <benchmark/benchmark.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+using ::aidl::android::hardware::usb::gadget::BnUsbGadgetCallback;
+using ::aidl::android::hardware::usb::gadget::GadgetFunction;
+using ::aidl::android::hardware::usb::gadget::IUsbGadget;
+using ::aidl::android::hardware::usb::gadget::Status;
+using ::aidl::android::hardware::usb::gadget::UsbSpeed;
+using ::android::base::GetProperty;
+using ::ndk::ScopedAStatus;
+
+// Matches the timeout UsbDeviceManager passes.
+constexpr int64_t kSwitchTimeoutMs = 2500;
+
+class SwitchCallback : public BnUsbGadgetCallback {
+public:
+    ScopedAStatus setCurrentUsbFunctionsCb(int64_t /* functions */, Status status,
+                                           int64_t transactionId) override {
+        std::lock_guard<std::mutex> lock(mLock);
+        if (transactionId == mTransactionId) mStatus = status;
+        mCv.notify_all();
+        return ScopedAStatus::ok();
+    }
+
+    ScopedAStatus getCurrentUsbFunctionsCb(int64_t functions, Status /* status */,
+                                           int64_t /* transactionId */) override {
+        std::lock_guard<std::mutex> lock(mLock);
+        mFunctions = functions;
+        mCv.notify_all();
+        return ScopedAStatus::ok();
+    }
+
+    ScopedAStatus getUsbSpeedCb(UsbSpeed /* speed */, int64_t /* transactionId */) override {
+        return ScopedAStatus::ok();
+    }
+
+    ScopedAStatus resetCb(Status /* status */, int64_t /* transactionId */) override {
+        return ScopedAStatus::ok();
+    }
+
+    // Switches to functions and waits for the HAL to report the outcome.
+    std::optional<Status> setFunctions(const std::shared_ptr<IUsbGadget>& gadget,
+                                       int64_t functions) {
+        std::unique_lock<std::mutex> lock(mLock);
+        int64_t transactionId = ++mTransactionId;
+
+        mStatus.reset();
+        lock.unlock();
+        if (!gadget->setCurrentUsbFunctions(functions, ref<SwitchCallback>(), kSwitchTimeoutMs,
+                                            transactionId)
+                     .isOk())
+            return std::nullopt;
+        lock.lock();
+        mCv.wait_for(lock, std::chrono::milliseconds(2 * kSwitchTimeoutMs),
+                     [this] { return mStatus.has_value(); });
+        return mStatus;
+    }
+
+    std::optional<int64_t> getFunctions(const std::shared_ptr<IUsbGadget>& gadget) {
+        std::unique_lock<std::mutex> lock(mLock);
+
+        mFunctions.reset();
+        lock.unlock();
+        if (!gadget->getCurrentUsbFunctions(ref<SwitchCallback>(), 0).isOk()) return std::nullopt;
+        lock.lock();
+        mCv.wait_for(lock, std::chrono::milliseconds(kSwitchTimeoutMs),
+                     [this] { return mFunctions.has_value(); });
+        return mFunctions;
+    }
+
+private:
+    std::mutex mLock;
+    std::condition_variable mCv;
+    int64_t mTransactionId = 0;
+    std::optional<Status> mStatus;
+    std::optional<int64_t> mFunctions;
+};
+
+static std::shared_ptr<IUsbGadget> gadgetService() {
+    const std::string instance = std::string() + IUsbGadget::descriptor + "/default";
+    return IUsbGadget::fromBinder(
+            ndk::SpAIBinder(AServiceManager_waitForService(instance.c_str())));
+}
+
+// Nearest rank percentile, as the HAL dump computes it.
+static double percentile(const std::vector<double>& v, int percent) {
+    std::vector<double> sorted(v);
+    size_t rank;
+
+    if (sorted.empty()) return 0;
+    std::sort(sorted.begin(), sorted.end());
+    rank = (sorted.size() * percent + 99) / 100;
+    return sorted[rank ? rank - 1 : 0];
+}
+
+static void BM_SetCurrentUsbFunctions(benchmark::State& state) {
+    std::shared_ptr<IUsbGadget> gadget = gadgetService();
+    auto callback = ndk::SharedRefBase::make<SwitchCallback>();
+    const int64_t compositions[] = {state.range(0), state.range(1)};
+    size_t next = 0;
+
+    std::optional<int64_t> original = callback->getFunctions(gadget);
+    if (!original.has_value()) {
+        state.SkipWithError("getCurrentUsbFunctions failed");
+        return;
+    }
+    if (*original == compositions[next]) next ^= 1;
+
+    for (auto _ : state) {
+        auto start = std::chrono::steady_clock::now();
+        std::optional<Status> status = callback->setFunctions(gadget, compositions[next]);
+        auto end = std::chrono::steady_clock::now();
+
+        if (status != Status::SUCCESS) {
+            state.SkipWithError("setCurrentUsbFunctions failed");
+            break;
+        }
+        state.SetIterationTime(std::chrono::duration<double>(end - start).count());
+        next ^= 1;
+    }
+
+    callback->setFunctions(gadget, *original);
+}
+
+BENCHMARK(BM_SetCurrentUsbFunctions)
+        ->Args({GadgetFunction::ADB | GadgetFunction::NCM,
+                GadgetFunction::ADB | GadgetFunction::RNDIS})
+        ->Args({GadgetFunction::ADB | GadgetFunction::NCM,
+                GadgetFunction::ADB | GadgetFunction::MIDI})
+        ->Iterations(1)
+        ->Repetitions(50)
+        ->ReportAggregatesOnly(true)
+        ->ComputeStatistics("p50", [](const std::vector<double>& v) { return percentile(v, 50); })
+        ->ComputeStatistics("p99", [](const std::vector<double>& v) { return percentile(v, 99); })
+        ->UseManualTime()
+        ->Unit(benchmark::kMillisecond);
+
+int main(int argc, char** argv) {
+    // Switches by UsbDeviceManager would land in the middle of the measurements
+    if (GetProperty("init.svc.zygote", "") == "running") {
+        fprintf(stderr, "The framework is running, stop it first: adb shell stop\n");
+        return 1;
+    }
+
+    ABinderProcess_setThreadPoolMaxThreadCount(1);
+    ABinderProcess_startThreadPool();
+
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) return 1;
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+
+    // Teardown, configure and FFS wait percentiles, these switches included
+    std::shared_ptr<IUsbGadget> gadget = gadgetService();
+    fflush(stdout);
+    return AIBinder_dump(gadget->asBinder().get(), STDOUT_FILENO, nullptr, 0) == STATUS_OK ? 0 : 1;
+}
@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2023 KonstaKANG
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Sequential read and write throughput of f_mass_storage over dummy_hcd.
+ * An image is exposed through a gadget of its own and the disk the host
+ * side enumerates is read and written with O_DIRECT, so only the gadget
+ * side page cache holds the image, as it would for a provisioning image.
+ *
+ *   adb shell /data/benchmarktest/usb_mass_storage_benchmark/usb_mass_storage_benchmark
+ */
+
+#include <android-base/unique_fd.h>
+#include <benchmark/benchmark.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <memory>
+#include <string>
+
+#include "DummyGadget.h"
+
+using ::android::base::unique_fd;
+
+constexpr char kImagePath[] = "/data/local/tmp/usb_mass_storage_benchmark.img";
+constexpr off_t kImageSize = 64 << 20;
+
+/*
+ * range(0): 1 writes, 0 reads.
+ * range(1): bytes per request.
+ */
+static void BM_MassStorageThroughput(benchmark::State& state) {
+    const bool write = state.range(0);
+    const size_t chunk = state.range(1);
+    std::string udc = DummyGadget::findUdc();
+    DummyGadget gadget;
+    std::string disk;
+
+    if (udc.empty()) {
+        state.SkipWithError("no dummy_hcd UDC, needs CONFIG_USB_DUMMY_HCD");
+        return;
+    }
+
+    unique_fd image(open(kImagePath, O_RDWR | O_CREAT | O_CLOEXEC, 0600));
+    if (image.get() < 0 || fallocate(image.get(), 0, 0, kImageSize)) {
+        state.SkipWithError("cannot create the backing image");
+        return;
+    }
+
+    // Ids of the kernel's own g_mass_storage, hosts bind it by class. The
+    // LUN holds the image open, it goes away with the gadget.
+    bool started = gadget.start(udc, "mass_storage.benchmark", "0x0525", "0xa4a5",
+                                {{"lun.0/file", kImagePath}});
+    unlink(kImagePath);
+    if (!started || (disk = DummyGadget::waitForHostDevice("/sys/class/block/", 5000)).empty()) {
+        state.SkipWithError("host side disk did not appear");
+        return;
+    }
+
+    // ueventd creates the node shortly after the disk
+    std::string node = "/dev/block/" + disk;
+    for (int i = 0; i < 200 && access(node.c_str(), F_OK); i++) usleep(10000);
+
+    unique_fd fd(open(node.c_str(), O_RDWR | O_DIRECT | O_CLOEXEC));
+    void* buf = nullptr;
+    if (fd.get() < 0 || posix_memalign(&buf, 4096, chunk)) {
+        state.SkipWithError("cannot open the host side disk");
+        return;
+    }
+    std::unique_ptr<void, decltype(&free)> buffer(buf, free);
+    memset(buf, 0x5a, chunk);
+
+    size_t bytes = 0;
+    for (auto _ : state) {
+        for (off_t offset = 0; offset + (off_t)chunk <= kImageSize; offset += chunk) {
+            ssize_t len = write ? pwrite(fd.get(), buf, chunk, offset)
+                                : pread(fd.get(), buf, chunk, offset);
+            if (len != (ssize_t)chunk) {
+                state.SkipWithError("short transfer");
+                break;
+            }
+            bytes += len;
+        }
+        if (write) fdatasync(fd.get());
+    }
+
+    state.SetBytesProcessed(bytes);
+}
+
+BENCHMARK(BM_MassStorageThroughput)
+        ->ArgNames({"write", "chunk"})
+        ->ArgsProduct({{0, 1}, {64 << 10, 1 << 20}})
+        ->Iterations(4)
+        ->Unit(benchmark::kMillisecond);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,223 @@
+/*
+ * Copyright (C) 2023 KonstaKANG
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Raw Ethernet throughput of the tethering functions over dummy_hcd. The
+ * gadget and host interfaces live in the same kernel, so frames go out
+ * through AF_PACKET on one and are counted on the other without IP routing
+ * short-circuiting the link. dummy_hcd has no wire speed, the results show
+ * what the u_ether and host driver paths cost in CPU with the qmult,
+ * max_segment_size and rps_cpus from vendor.prop, against the defaults.
+ *
+ *   adb shell /data/benchmarktest/usb_net_throughput_benchmark/usb_net_throughput_benchmark
+ */
+
+#include <android-base/file.h>
+#include <android-base/properties.h>
+#include <android-base/strings.h>
+#include <android-base/unique_fd.h>
+#include <arpa/inet.h>
+#include <benchmark/benchmark.h>
+#include <linux/if_packet.h>
+#include <net/ethernet.h>
+#include <net/if.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "DummyGadget.h"
+
+using ::android::base::GetProperty;
+using ::android::base::ReadFileToString;
+using ::android::base::Trim;
+using ::android::base::unique_fd;
+using ::android::base::WriteStringToFile;
+
+// IEEE 802 local experimental ethertype, nothing else on the link uses it.
+constexpr uint16_t kEtherType = 0x88b5;
+constexpr size_t kFrameSize = ETH_FRAME_LEN;
+constexpr int kBurst = 256;
+constexpr int kDrainTimeoutMs = 100;
+constexpr int kSocketBuffer = 8 << 20;
+
+struct NetLink {
+    std::string name;
+    int index;
+    uint8_t mac[ETH_ALEN];
+};
+
+static bool readLink(const std::string& name, NetLink* link) {
+    std::string address;
+
+    link->name = name;
+    link->index = if_nametoindex(name.c_str());
+    if (!link->index || !ReadFileToString("/sys/class/net/" + name + "/address", &address))
+        return false;
+    return sscanf(address.c_str(), "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx", &link->mac[0], &link->mac[1],
+                  &link->mac[2], &link->mac[3], &link->mac[4], &link->mac[5]) == ETH_ALEN;
+}
+
+// Brings the interface up and waits for the other side to set the data interface.
+static bool bringUp(const NetLink& link) {
+    unique_fd fd(socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0));
+    struct ifreq ifr = {};
+    std::string carrier;
+
+    strlcpy(ifr.ifr_name, link.name.c_str(), IFNAMSIZ);
+    if (ioctl(fd.get(), SIOCGIFFLAGS, &ifr)) return false;
+    ifr.ifr_flags |= IFF_UP;
+    if (ioctl(fd.get(), SIOCSIFFLAGS, &ifr)) return false;
+
+    for (int i = 0; i < 500; i++) {
+        if (ReadFileToString("/sys/class/net/" + link.name + "/carrier", &carrier) &&
+            Trim(carrier) == "1")
+            return true;
+        usleep(10000);
+    }
+    return false;
+}
+
+static unique_fd openPacketSocket(const NetLink& link) {
+    unique_fd fd(socket(AF_PACKET, SOCK_RAW | SOCK_CLOEXEC, htons(kEtherType)));
+    struct sockaddr_ll addr = {};
+
+    addr.sll_family = AF_PACKET;
+    addr.sll_protocol = htons(kEtherType);
+    addr.sll_ifindex = link.index;
+    if (fd.get() < 0 || bind(fd.get(), (struct sockaddr*)&addr, sizeof(addr))) return unique_fd();
+
+    setsockopt(fd.get(), SOL_SOCKET, SO_RCVBUFFORCE, &kSocketBuffer, sizeof(kSocketBuffer));
+    setsockopt(fd.get(), SOL_SOCKET, SO_SNDBUFFORCE, &kSocketBuffer, sizeof(kSocketBuffer));
+    return fd;
+}
+
+/*
+ * Sends one burst of full sized frames from tx to rx and drains rx until
+ * all arrived or the link went quiet. Returns the bytes received.
+ */
+static size_t transferBurst(int txFd, int rxFd, const uint8_t* frame,
+                            std::chrono::steady_clock::time_point* last) {
+    uint8_t buf[kFrameSize];
+    struct pollfd pfd = {rxFd, POLLIN, 0};
+    size_t received = 0;
+    int frames = 0;
+
+    for (int i = 0; i < kBurst; i++) send(txFd, frame, kFrameSize, 0);
+    *last = std::chrono::steady_clock::now();
+
+    while (frames < kBurst && poll(&pfd, 1, kDrainTimeoutMs) > 0) {
+        ssize_t len;
+        while ((len = recv(rxFd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+            received += len;
+            frames++;
+        }
+        *last = std::chrono::steady_clock::now();
+    }
+    return received;
+}
+
+/*
+ * range(0): 1 sends gadget to host, 0 host to gadget.
+ * range(1): 1 applies the vendor.prop tuning, 0 leaves u_ether defaults.
+ */
+static void BM_NetThroughput(benchmark::State& state, const std::string& function) {
+    const bool toHost = state.range(0);
+    const bool tuned = state.range(1);
+    std::vector<std::pair<std::string, std::string>> attributes;
+    std::string udc = DummyGadget::findUdc();
+    DummyGadget gadget;
+    std::string ifname;
+    NetLink gadgetLink, hostLink;
+
+    if (udc.empty()) {
+        state.SkipWithError("no dummy_hcd UDC, needs CONFIG_USB_DUMMY_HCD");
+        return;
+    }
+
+    // The same attributes configureNetFunction() writes
+    if (tuned) {
+        std::string qmult = GetProperty("ro.vendor.usb.net.qmult", "");
+        std::string segment = GetProperty("ro.vendor.usb.ncm.max_segment_size", "");
+        if (!qmult.empty()) attributes.push_back({"qmult", qmult});
+        if (!segment.empty() && function == "ncm")
+            attributes.push_back({"max_segment_size", segment});
+    }
+
+    // Ids of the kernel's own g_ncm and g_ether, hosts bind them by class
+    if (!gadget.start(udc, function + ".benchmark", "0x0525",
+                      function == "ncm" ? "0xa4a1" : "0xa4a2", attributes) ||
+        !ReadFileToString(gadget.functionPath() + "ifname", &ifname) ||
+        !readLink(Trim(ifname), &gadgetLink) ||
+        !readLink(DummyGadget::waitForHostDevice("/sys/class/net/", 5000), &hostLink) ||
+        !bringUp(gadgetLink) || !bringUp(hostLink)) {
+        state.SkipWithError("gadget network link did not come up");
+        return;
+    }
+
+    std::string rps = tuned ? GetProperty("ro.vendor.usb.net.rps_cpus", "0") : "0";
+    WriteStringToFile(rps, "/sys/class/net/" + gadgetLink.name + "/queues/rx-0/rps_cpus");
+
+    const NetLink& tx = toHost ? gadgetLink : hostLink;
+    const NetLink& rx = toHost ? hostLink : gadgetLink;
+    unique_fd txFd = openPacketSocket(tx);
+    unique_fd rxFd = openPacketSocket(rx);
+    if (txFd.get() < 0 || rxFd.get() < 0) {
+        state.SkipWithError("cannot open packet sockets");
+        return;
+    }
+
+    uint8_t frame[kFrameSize] = {};
+    struct ether_header* eth = reinterpret_cast<struct ether_header*>(frame);
+    memcpy(eth->ether_dhost, rx.mac, ETH_ALEN);
+    memcpy(eth->ether_shost, tx.mac, ETH_ALEN);
+    eth->ether_type = htons(kEtherType);
+
+    size_t bytes = 0;
+    int64_t dropped = 0;
+    for (auto _ : state) {
+        auto start = std::chrono::steady_clock::now();
+        std::chrono::steady_clock::time_point last;
+        size_t received = transferBurst(txFd.get(), rxFd.get(), frame, &last);
+
+        state.SetIterationTime(std::chrono::duration<double>(last - start).count());
+        bytes += received;
+        dropped += kBurst - received / kFrameSize;
+    }
+
+    state.SetBytesProcessed(bytes);
+    state.counters["Mbit/s"] = benchmark::Counter(bytes * 8 / 1e6, benchmark::Counter::kIsRate);
+    state.counters["dropped"] = dropped;
+}
+
+BENCHMARK_CAPTURE(BM_NetThroughput, ncm, std::string("ncm"))
+        ->ArgNames({"to_host", "tuned"})
+        ->ArgsProduct({{0, 1}, {0, 1}})
+        ->Iterations(200)
+        ->UseManualTime();
+BENCHMARK_CAPTURE(BM_NetThroughput, rndis, std::string("rndis"))
+        ->ArgNames({"to_host", "tuned"})
+        ->ArgsProduct({{0, 1}, {0, 1}})
+        ->Iterations(200)
+        ->UseManualTime();
+
+BENCHMARK_MAIN();
@@ -15,39 +15,27 @@
  * limitations under the License.
  */
 
-#define LOG_TAG "android.hardware.usb.gadget@1.2-service.rpi"
+#define LOG_TAG "android.hardware.usb.gadget-service.rpi"
 
-#include <hidl/HidlTransportSupport.h>
 #include "UsbGadget.h"
 
-using android::sp;
+#include <android-base/logging.h>
+#include <android/binder_manager.h>
+#include <android/binder_process.h>
 
-// libhwbinder:
-using android::hardware::configureRpcThreadpool;
-using android::hardware::joinRpcThreadpool;
-
-// Generated HIDL files
-using android::hardware::usb::gadget::V1_2::IUsbGadget;
-using android::hardware::usb::gadget::V1_2::implementation::UsbGadget;
-
-using android::OK;
-using android::status_t;
+using ::aidl::android::hardware::usb::gadget::UsbGadget;
 
 int main() {
-    configureRpcThreadpool(1, true /*callerWillJoin*/);
-
-    android::sp<IUsbGadget> service = new UsbGadget();
-
-    status_t status = service->registerAsService();
+    // Binder calls only queue work, the gadget is configured on its own thread
+    ABinderProcess_setThreadPoolMaxThreadCount(0);
+    std::shared_ptr<UsbGadget> usbGadget = ndk::SharedRefBase::make<UsbGadget>();
 
-    if (status != OK) {
-        ALOGE("Cannot register USB Gadget HAL service");
-        return 1;
-    }
+    const std::string instance = std::string() + UsbGadget::descriptor + "/default";
+    binder_status_t status =
+            AServiceManager_addService(usbGadget->asBinder().get(), instance.c_str());
+    CHECK(status == STATUS_OK);
 
     ALOGI("USB Gadget HAL Ready.");
-    joinRpcThreadpool();
-    // Under noraml cases, execution will not reach this line.
-    ALOGI("USB Gadget HAL failed to join thread pool.");
-    return 1;
+    ABinderProcess_joinThreadPool();
+    return EXIT_FAILURE;  // should not reached
 }